@@ -0,0 +1,580 @@
+// HTTP load generator used to benchmark SimpleHttpServer.
+//
+// Closed loop: every connection keeps --pipeline requests in flight and
+// sends the next one as soon as a response arrives.
+// Open loop: requests are issued at a fixed --rate regardless of how fast
+// the server answers; latency is measured from the time a request was
+// scheduled, so queueing delay is not hidden (no coordinated omission).
+
+#include "SimpleHttpServer.hpp"
+
+#include <cstdlib>
+#include <random>
+
+namespace LoadGenerator {
+    typedef std::chrono::steady_clock Clock;
+
+    struct RequestTemplate
+    {
+        uint32_t weight;
+        std::string method;
+        std::string path;
+        std::string data;
+    };
+
+    struct Options
+    {
+        std::string host = "127.0.0.1";
+        uint16_t port = 3000;
+        std::string unixPath; // Connects to a Unix domain socket instead of host:port
+        std::size_t threads = 1;
+        std::size_t connections = 16;
+        std::size_t pipeline = 1;
+        double duration = 10.0;
+        double warmup = 1.0;
+        double rate = 0.0; // Requests per second, 0 runs closed loop
+        bool keepAlive = true;
+        bool self = false; // Benchmark an in-process server
+        Simple::ListenOptions selfListen;
+        std::size_t selfWorkers = 1;
+        std::chrono::milliseconds selfCache{0}; // Response cache ttl of GET /
+        std::vector<RequestTemplate> requests;
+    };
+
+    struct Stats
+    {
+        Simple::Details::LogLinearHistogram latency;
+        uint64_t responses = 0;
+        uint64_t non2xx = 0;
+        uint64_t errors = 0;
+        uint64_t connects = 0;
+        uint64_t bytesReceived = 0;
+    };
+
+    class Worker;
+
+    class Connection : public std::enable_shared_from_this<Connection>
+    {
+    public:
+        Connection(Worker& worker, std::size_t index);
+        void Start();
+
+    private:
+        void Connect();
+        void Tick();
+        void Enqueue(Clock::time_point intended);
+        void Flush();
+        void Read();
+        bool ParseResponses();
+        void Reconnect();
+
+    private:
+        Worker& m_Worker;
+        asio::generic::stream_protocol::socket m_Socket; // TCP or Unix domain
+        asio::steady_timer m_Timer;
+        asio::steady_timer m_RetryTimer;
+        std::minstd_rand m_Random;
+        std::discrete_distribution<std::size_t> m_Pick;
+        Clock::time_point m_NextTick;
+        Clock::duration m_Interval{};
+        std::deque<Clock::time_point> m_Waiting;  // Scheduled, not sent yet
+        std::deque<Clock::time_point> m_InFlight; // Sent, awaiting a response
+        std::string m_Outgoing;
+        std::string m_Writing;
+        std::string m_Incoming;
+        std::array<char, 16 * 1024> m_ReadBuffer;
+        bool m_Connected = false;
+        bool m_CloseAfterResponse = false;
+        uint64_t m_Generation = 0; // Invalidates handlers of a replaced socket
+    };
+
+    class Worker
+    {
+    public:
+        Worker(const Options& options, const std::vector<std::string>& requests, const std::vector<uint32_t>& weights,
+               asio::generic::stream_protocol::endpoint endpoint, Clock::time_point measureStart, Clock::time_point measureEnd) :
+            options(options), requests(requests), weights(weights), endpoint(endpoint),
+            measureStart(measureStart), measureEnd(measureEnd), m_Stats(std::make_unique<Stats>())
+        {
+        }
+
+        void AddConnection(std::size_t index)
+        {
+            m_Connections.push_back(std::make_shared<Connection>(*this, index));
+        }
+
+        void Run()
+        {
+            for (auto& connection : m_Connections)
+                connection->Start();
+            m_Thread = std::thread([this] () { context.run(); });
+        }
+
+        void Stop()
+        {
+            context.stop();
+            if (m_Thread.joinable())
+                m_Thread.join();
+        }
+
+        bool Measuring(Clock::time_point now) const { return now >= measureStart && now < measureEnd; }
+        Stats& stats() { return *m_Stats; }
+
+        const Options& options;
+        const std::vector<std::string>& requests;
+        const std::vector<uint32_t>& weights;
+        const asio::generic::stream_protocol::endpoint endpoint;
+        const Clock::time_point measureStart;
+        const Clock::time_point measureEnd;
+        asio::io_context context;
+
+    private:
+        std::unique_ptr<Stats> m_Stats;
+        std::vector<std::shared_ptr<Connection>> m_Connections;
+        std::thread m_Thread;
+    };
+
+    Connection::Connection(Worker& worker, std::size_t index) :
+        m_Worker(worker), m_Socket(worker.context), m_Timer(worker.context), m_RetryTimer(worker.context),
+        m_Random(static_cast<uint32_t>(index + 1)), m_Pick(worker.weights.begin(), worker.weights.end())
+    {
+    }
+
+    void Connection::Start()
+    {
+        if (m_Worker.options.rate > 0)
+        {
+            // Every connection carries an equal share of the rate, with
+            // start times spread so they do not fire in lockstep
+            double perConnection = m_Worker.options.rate / m_Worker.options.connections;
+            m_Interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / perConnection));
+            m_NextTick = Clock::now() + m_Interval * (m_Random() % 1000) / 1000;
+            Tick();
+        }
+        else
+        {
+            for (std::size_t i = 0; i < m_Worker.options.pipeline; i++)
+                m_Waiting.push_back(Clock::now());
+        }
+        Connect();
+    }
+
+    void Connection::Connect()
+    {
+        auto self(shared_from_this());
+        uint64_t generation = ++m_Generation;
+        m_Socket = asio::generic::stream_protocol::socket(m_Worker.context);
+        m_Socket.async_connect(m_Worker.endpoint,
+            [this, self, generation] (const asio::error_code& ec)
+            {
+                if (generation != m_Generation)
+                    return;
+                if (ec)
+                {
+                    m_Worker.stats().errors++;
+                    m_RetryTimer.expires_after(std::chrono::milliseconds(10));
+                    m_RetryTimer.async_wait([this, self] (const asio::error_code&) { Connect(); });
+                    return;
+                }
+
+                asio::error_code ignored; // Not an option of Unix domain sockets
+                m_Socket.set_option(asio::ip::tcp::no_delay(true), ignored);
+                m_Worker.stats().connects++;
+                m_Connected = true;
+                m_CloseAfterResponse = false;
+                m_Incoming.clear();
+                Read();
+                Flush();
+            }
+        );
+    }
+
+    void Connection::Tick()
+    {
+        auto self(shared_from_this());
+        m_Timer.expires_at(m_NextTick);
+        m_Timer.async_wait(
+            [this, self] (const asio::error_code& ec)
+            {
+                if (ec)
+                    return;
+
+                auto now = Clock::now();
+                while (m_NextTick <= now)
+                {
+                    Enqueue(m_NextTick);
+                    m_NextTick += m_Interval;
+                }
+                Flush();
+                Tick();
+            }
+        );
+    }
+
+    void Connection::Enqueue(Clock::time_point intended)
+    {
+        m_Waiting.push_back(intended);
+    }
+
+    void Connection::Flush()
+    {
+        if (!m_Connected)
+            return;
+
+        std::size_t depth = m_Worker.options.keepAlive ? m_Worker.options.pipeline : 1;
+        while (!m_Waiting.empty() && m_InFlight.size() < depth)
+        {
+            m_Outgoing += m_Worker.requests[m_Worker.requests.size() == 1 ? 0 : m_Pick(m_Random)];
+            m_InFlight.push_back(m_Waiting.front());
+            m_Waiting.pop_front();
+        }
+
+        if (m_Outgoing.empty() || !m_Writing.empty())
+            return;
+
+        m_Writing.swap(m_Outgoing);
+        auto self(shared_from_this());
+        uint64_t generation = m_Generation;
+        asio::async_write(m_Socket, asio::buffer(m_Writing),
+            [this, self, generation] (const asio::error_code& ec, std::size_t)
+            {
+                if (generation != m_Generation)
+                    return;
+                m_Writing.clear();
+                if (ec)
+                {
+                    Reconnect();
+                    return;
+                }
+                Flush();
+            }
+        );
+    }
+
+    void Connection::Read()
+    {
+        auto self(shared_from_this());
+        uint64_t generation = m_Generation;
+        m_Socket.async_read_some(asio::buffer(m_ReadBuffer),
+            [this, self, generation] (const asio::error_code& ec, std::size_t bytes)
+            {
+                if (generation != m_Generation)
+                    return;
+                if (ec)
+                {
+                    Reconnect();
+                    return;
+                }
+
+                if (m_Worker.Measuring(Clock::now()))
+                    m_Worker.stats().bytesReceived += bytes;
+                m_Incoming.append(m_ReadBuffer.data(), bytes);
+                if (!ParseResponses())
+                {
+                    Reconnect();
+                    return;
+                }
+                if (m_CloseAfterResponse && m_InFlight.empty())
+                {
+                    Reconnect();
+                    return;
+                }
+                Flush();
+                Read();
+            }
+        );
+    }
+
+    // Consumes every complete response in m_Incoming. Returns false on a
+    // malformed response.
+    bool Connection::ParseResponses()
+    {
+        std::size_t offset = 0;
+        for (;;)
+        {
+            std::size_t headerEnd = m_Incoming.find("\r\n\r\n", offset);
+            if (headerEnd == std::string::npos)
+                break;
+
+            if (m_Incoming.compare(offset, 5, "HTTP/") != 0 || m_Incoming.size() < offset + 12)
+                return false;
+            int status = std::atoi(m_Incoming.c_str() + offset + 9);
+
+            std::size_t contentLength = 0;
+            bool close = false;
+            std::size_t line = m_Incoming.find("\r\n", offset) + 2;
+            while (line < headerEnd)
+            {
+                std::size_t lineEnd = m_Incoming.find("\r\n", line);
+                std::size_t colon = m_Incoming.find(':', line);
+                if (colon != std::string::npos && colon < lineEnd)
+                {
+                    std::string name = m_Incoming.substr(line, colon - line);
+                    std::size_t value = m_Incoming.find_first_not_of(' ', colon + 1);
+                    if (strcasecmp(name.c_str(), "Content-Length") == 0)
+                        contentLength = std::strtoul(m_Incoming.c_str() + value, nullptr, 10);
+                    else if (strcasecmp(name.c_str(), "Connection") == 0)
+                        close = strncasecmp(m_Incoming.c_str() + value, "close", 5) == 0;
+                }
+                line = lineEnd + 2;
+            }
+
+            std::size_t end = headerEnd + 4 + contentLength;
+            if (end > m_Incoming.size())
+                break;
+            offset = end;
+
+            if (m_InFlight.empty())
+                return false;
+
+            auto now = Clock::now();
+            auto intended = m_InFlight.front();
+            m_InFlight.pop_front();
+            if (m_Worker.Measuring(now))
+            {
+                auto& stats = m_Worker.stats();
+                stats.responses++;
+                if (status < 200 || status > 299)
+                    stats.non2xx++;
+                stats.latency.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - intended).count());
+            }
+
+            if (m_Worker.options.rate <= 0)
+                m_Waiting.push_back(now);
+            if (close || !m_Worker.options.keepAlive)
+                m_CloseAfterResponse = true;
+        }
+        m_Incoming.erase(0, offset);
+        return true;
+    }
+
+    void Connection::Reconnect()
+    {
+        if (!m_InFlight.empty() && !m_CloseAfterResponse)
+            m_Worker.stats().errors++;
+
+        // Requests lost with the connection are sent again, keeping the
+        // time they were first scheduled
+        while (!m_InFlight.empty())
+        {
+            m_Waiting.push_front(m_InFlight.back());
+            m_InFlight.pop_back();
+        }
+        asio::error_code ignored;
+        m_Socket.close(ignored);
+        m_Connected = false;
+        m_Writing.clear();
+        m_Outgoing.clear();
+        Connect();
+    }
+
+    void PrintUsage()
+    {
+        std::cout <<
+            "Usage: LoadGenerator [options]\n"
+            "  --host <address>          Server address (127.0.0.1)\n"
+            "  --port <port>             Server port (3000)\n"
+            "  --unix <path>             Connect to a Unix domain socket instead\n"
+            "  --threads <n>             Client threads (1)\n"
+            "  --connections <n>         Open connections (16)\n"
+            "  --pipeline <n>            Requests in flight per connection (1)\n"
+            "  --duration <seconds>      Measured duration (10)\n"
+            "  --warmup <seconds>        Unmeasured warmup (1)\n"
+            "  --rate <rps>              Open loop at a fixed request rate (closed loop when omitted)\n"
+            "  --no-keep-alive           One request per connection\n"
+            "  --request <[w:]METHOD PATH[ BODY]>\n"
+            "                            Adds a request to the mix with weight w (GET /)\n"
+            "  --self                    Benchmark an in-process server on --port (and --unix)\n"
+            "  --self-option <name=value>\n"
+            "                            Listener setting of the in-process server: nodelay, quickack,\n"
+            "                            rcvbuf, sndbuf, busypoll (us), deferaccept (s), fastopen, backlog,\n"
+            "                            acceptbatch\n"
+            "  --self-workers <n>        Worker threads of the in-process server (1)\n"
+            "  --self-cache <ms>         Serves GET / of the in-process server from the response cache\n";
+    }
+
+    void ParseSelfOption(const std::string& spec, Simple::ListenOptions& listen)
+    {
+        std::size_t equals = spec.find('=');
+        if (equals == std::string::npos)
+            throw std::runtime_error("Expected name=value: " + spec);
+        std::string name = spec.substr(0, equals);
+        int value = std::stoi(spec.substr(equals + 1));
+        if (name == "nodelay") listen.socket.noDelay = value != 0;
+        else if (name == "quickack") listen.socket.quickAck = value != 0;
+        else if (name == "rcvbuf") listen.socket.receiveBuffer = value;
+        else if (name == "sndbuf") listen.socket.sendBuffer = value;
+        else if (name == "busypoll") listen.socket.busyPoll = std::chrono::microseconds(value);
+        else if (name == "deferaccept") listen.deferAccept = std::chrono::seconds(value);
+        else if (name == "fastopen") listen.fastOpenQueue = value;
+        else if (name == "backlog") listen.backlog = value;
+        else if (name == "acceptbatch") listen.acceptBatch = static_cast<std::size_t>(value);
+        else
+            throw std::runtime_error("Unknown server option " + name);
+    }
+
+    bool ParseOptions(int argc, char** argv, Options& options)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            auto value = [&] () -> std::string {
+                if (i + 1 >= argc)
+                    throw std::runtime_error("Missing value for " + arg);
+                return argv[++i];
+            };
+
+            if (arg == "--host") options.host = value();
+            else if (arg == "--port") options.port = static_cast<uint16_t>(std::stoul(value()));
+            else if (arg == "--unix") options.unixPath = value();
+            else if (arg == "--threads") options.threads = std::stoul(value());
+            else if (arg == "--connections") options.connections = std::stoul(value());
+            else if (arg == "--pipeline") options.pipeline = std::stoul(value());
+            else if (arg == "--duration") options.duration = std::stod(value());
+            else if (arg == "--warmup") options.warmup = std::stod(value());
+            else if (arg == "--rate") options.rate = std::stod(value());
+            else if (arg == "--no-keep-alive") options.keepAlive = false;
+            else if (arg == "--self") options.self = true;
+            else if (arg == "--self-option") ParseSelfOption(value(), options.selfListen);
+            else if (arg == "--self-workers") options.selfWorkers = std::stoul(value());
+            else if (arg == "--self-cache") options.selfCache = std::chrono::milliseconds(std::stoul(value()));
+            else if (arg == "--request")
+            {
+                std::string spec = value();
+                RequestTemplate request{1, "GET", "/", ""};
+                std::size_t colon = spec.find(':');
+                std::size_t space = spec.find(' ');
+                if (colon != std::string::npos && colon < space)
+                {
+                    request.weight = static_cast<uint32_t>(std::stoul(spec.substr(0, colon)));
+                    spec = spec.substr(colon + 1);
+                }
+                std::istringstream parts(spec);
+                parts >> request.method >> request.path;
+                std::getline(parts >> std::ws, request.data);
+                options.requests.push_back(request);
+            }
+            else
+            {
+                PrintUsage();
+                return false;
+            }
+        }
+
+        if (options.requests.empty())
+            options.requests.push_back({1, "GET", "/", ""});
+        options.threads = std::max<std::size_t>(1, std::min(options.threads, options.connections));
+        options.pipeline = std::max<std::size_t>(1, options.pipeline);
+        return true;
+    }
+
+    std::string Serialize(const Options& options, const RequestTemplate& request)
+    {
+        std::string out = request.method + " " + request.path + " HTTP/1.1\r\n";
+        out += "Host: " + options.host + ":" + std::to_string(options.port) + "\r\n";
+        if (!options.keepAlive)
+            out += "Connection: close\r\n";
+        if (!request.data.empty() || request.method == "POST" || request.method == "PUT")
+            out += "Content-Length: " + std::to_string(request.data.size()) + "\r\n";
+        out += "\r\n" + request.data;
+        return out;
+    }
+
+    void StartSelfServer(const Options& options)
+    {
+        // Leaked on purpose: the process exits right after the report
+        auto* server = new Simple::HttpServer();
+        server->SetWorkerThreads(options.selfWorkers);
+        server->Listen(options.host, options.port, options.selfListen);
+        if (!options.unixPath.empty())
+            server->ListenUnix(options.unixPath, options.selfListen);
+        Simple::RouteOptions cached;
+        cached.cache.ttl = options.selfCache;
+        server->Get("/", [] (const Simple::Request& req, Simple::Response& res) {
+            res.body = "Saludos desde el servidor";
+        }, cached);
+        server->Post("/", [] (const Simple::Request& req, Simple::Response& res) {
+            res.body = req.body;
+        });
+        server->Start();
+    }
+}
+
+int main(int argc, char** argv)
+{
+    using namespace LoadGenerator;
+
+    Options options;
+    try
+    {
+        if (!ParseOptions(argc, argv, options))
+            return 1;
+        if (options.self)
+            StartSelfServer(options);
+    }
+    catch (const std::exception& ex)
+    {
+        std::cerr << ex.what() << "\n";
+        return 1;
+    }
+
+    std::vector<std::string> requests;
+    std::vector<uint32_t> weights;
+    for (auto& request : options.requests)
+    {
+        requests.push_back(Serialize(options, request));
+        weights.push_back(request.weight);
+    }
+
+    asio::generic::stream_protocol::endpoint endpoint = options.unixPath.empty() ?
+        asio::generic::stream_protocol::endpoint(asio::ip::tcp::endpoint(asio::ip::make_address(options.host), options.port)) :
+        asio::generic::stream_protocol::endpoint(asio::local::stream_protocol::endpoint(options.unixPath));
+    auto start = Clock::now();
+    auto measureStart = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(options.warmup));
+    auto measureEnd = measureStart + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(options.duration));
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (std::size_t i = 0; i < options.threads; i++)
+        workers.push_back(std::make_unique<Worker>(options, requests, weights, endpoint, measureStart, measureEnd));
+    for (std::size_t i = 0; i < options.connections; i++)
+        workers[i % workers.size()]->AddConnection(i);
+
+    std::cout << "Running " << options.duration << "s (" << options.warmup << "s warmup) against "
+              << (options.unixPath.empty() ? options.host + ":" + std::to_string(options.port) : options.unixPath) << ", " << options.threads << " threads, "
+              << options.connections << " connections, pipeline " << options.pipeline << ", "
+              << (options.rate > 0 ? "open loop at " + std::to_string(static_cast<uint64_t>(options.rate)) + " req/s" : std::string("closed loop"))
+              << (options.keepAlive ? "" : ", no keep-alive") << "\n";
+
+    for (auto& worker : workers)
+        worker->Run();
+    std::this_thread::sleep_until(measureEnd);
+    for (auto& worker : workers)
+        worker->Stop();
+
+    Stats total;
+    for (auto& worker : workers)
+    {
+        auto& stats = worker->stats();
+        total.latency.Merge(stats.latency);
+        total.responses += stats.responses;
+        total.non2xx += stats.non2xx;
+        total.errors += stats.errors;
+        total.connects += stats.connects;
+        total.bytesReceived += stats.bytesReceived;
+    }
+
+    double seconds = options.duration;
+    std::cout << std::fixed << std::setprecision(2)
+              << "Requests:     " << total.responses << " (" << total.non2xx << " non-2xx, " << total.errors << " errors, "
+              << total.connects << " connects)\n"
+              << "Throughput:   " << total.responses / seconds << " req/s, "
+              << total.bytesReceived / seconds / (1024 * 1024) << " MiB/s received\n"
+              << "Latency (us): mean " << total.latency.Mean() / 1e3
+              << ", p50 " << total.latency.ValueAtPercentile(50.0) / 1e3
+              << ", p90 " << total.latency.ValueAtPercentile(90.0) / 1e3
+              << ", p99 " << total.latency.ValueAtPercentile(99.0) / 1e3
+              << ", p99.9 " << total.latency.ValueAtPercentile(99.9) / 1e3
+              << ", max " << total.latency.Max() / 1e3 << "\n";
+
+    std::exit(0);
+}
@@ -0,0 +1,281 @@
+// Fuzz target and differential harness for Details::ParseRequest.
+//
+// Every input is checked for:
+//  - agreement between the live parser and the frozen reference parser
+//    (result and, for completed requests, every parsed field);
+//  - a methodType classification matching the method string;
+//  - agreement of the headers-only mode used by the server with the whole
+//    request mode, and its own consistency under byte-split feeding;
+//  - consistency under byte-split feeding: a prefix of the input may only
+//    report an outcome other than "incomplete" if the whole input reports
+//    the same outcome with the same fields, as a streaming parser would.
+//
+// Built with -DSIMPLE_LIBFUZZER and -fsanitize=fuzzer it is a libFuzzer
+// target (premake5 gmake2 --fuzzer). Otherwise it runs standalone: the
+// arguments are corpus files to replay, or it mutates a built-in seed
+// corpus for -runs=N iterations.
+
+#include "SimpleHttpServer.hpp"
+#include "ReferenceParser.hpp"
+
+#include <cstdlib>
+#include <fstream>
+#include <random>
+
+namespace FuzzParser {
+    enum Outcome
+    {
+        Completed,
+        Incompleted,
+        Error
+    };
+
+    struct Parsed
+    {
+        Outcome outcome;
+        Simple::Request request;
+    };
+
+    Outcome FromLive(Simple::Details::ParseResult result)
+    {
+        switch (result)
+        {
+        case Simple::Details::ParsingCompleted: return Completed;
+        case Simple::Details::ParsingIncompleted: return Incompleted;
+        default: return Error;
+        }
+    }
+
+    Outcome FromReference(Reference::ParseResult result)
+    {
+        switch (result)
+        {
+        case Reference::ParsingCompleted: return Completed;
+        case Reference::ParsingIncompleted: return Incompleted;
+        default: return Error;
+        }
+    }
+
+    Parsed ParseLive(const std::string& data, Simple::Details::ParseMode mode = Simple::Details::ParseWholeRequest)
+    {
+        Parsed parsed;
+        parsed.outcome = FromLive(Simple::Details::ParseRequest(data, parsed.request, mode));
+        return parsed;
+    }
+
+    Parsed ParseReference(const std::string& data)
+    {
+        Parsed parsed;
+        parsed.outcome = FromReference(Reference::ParseRequest(data, parsed.request));
+        return parsed;
+    }
+
+    const char* OutcomeName(Outcome outcome)
+    {
+        switch (outcome)
+        {
+        case Completed: return "completed";
+        case Incompleted: return "incomplete";
+        default: return "error";
+        }
+    }
+
+    // Fields are only defined once a request completed.
+    std::string Difference(const Parsed& a, const Parsed& b)
+    {
+        if (a.outcome != b.outcome)
+            return std::string("outcome ") + OutcomeName(a.outcome) + " != " + OutcomeName(b.outcome);
+        if (a.outcome != Completed)
+            return "";
+        if (a.request.method != b.request.method)
+            return "method '" + a.request.method + "' != '" + b.request.method + "'";
+        if (a.request.path != b.request.path)
+            return "path '" + a.request.path + "' != '" + b.request.path + "'";
+        if (a.request.versionMajor != b.request.versionMajor || a.request.versionMinor != b.request.versionMinor)
+            return "version differs";
+        if (a.request.contentLength != b.request.contentLength)
+            return "contentLength " + std::to_string(a.request.contentLength) + " != " + std::to_string(b.request.contentLength);
+        if (a.request.headers != b.request.headers)
+            return "headers differ";
+        if (a.request.params != b.request.params)
+            return "params differ";
+        return "";
+    }
+
+    std::string Escape(const std::string& data)
+    {
+        static const char* hex = "0123456789abcdef";
+        std::string out;
+        for (unsigned char c : data)
+        {
+            if (c == '\r') out += "\\r";
+            else if (c == '\n') out += "\\n";
+            else if (c == '\\') out += "\\\\";
+            else if (c < 0x20 || c >= 0x7f) { out += "\\x"; out.push_back(hex[c >> 4]); out.push_back(hex[c & 0xf]); }
+            else out.push_back(static_cast<char>(c));
+        }
+        return out;
+    }
+
+    [[noreturn]] void Fail(const std::string& what, const std::string& data)
+    {
+        std::cerr << "FuzzParser: " << what << "\n  input (" << data.size() << " bytes): \"" << Escape(data) << "\"\n";
+        std::abort();
+    }
+
+    void CheckInput(const std::string& data)
+    {
+        Parsed live = ParseLive(data);
+        Parsed reference = ParseReference(data);
+        std::string difference = Difference(live, reference);
+        if (!difference.empty())
+            Fail("live and reference parsers disagree: " + difference, data);
+        if (live.outcome == Completed && live.request.methodType != Simple::Details::ParseMethod(live.request.method))
+            Fail("methodType does not match method '" + live.request.method + "'", data);
+
+        // Headers-only mode stops at the end of the headers and reads every
+        // Content-Length; otherwise it agrees with the whole request mode.
+        Parsed headers = ParseLive(data, Simple::Details::ParseHeadersOnly);
+        if (live.outcome == Completed && headers.outcome == Completed)
+        {
+            Parsed comparable = headers;
+            comparable.request.contentLength = live.request.contentLength;
+            difference = Difference(comparable, live);
+            if (!difference.empty())
+                Fail("headers-only mode disagrees with whole request mode: " + difference, data);
+        }
+
+        // Every split point for short inputs, an even sample for long ones
+        std::size_t step = data.size() <= 512 ? 1 : data.size() / 256;
+        for (std::size_t split = 0; split < data.size(); split += step)
+        {
+            Parsed prefix = ParseLive(data.substr(0, split));
+            if (prefix.outcome != Incompleted)
+            {
+                difference = Difference(prefix, live);
+                if (!difference.empty())
+                    Fail("split at byte " + std::to_string(split) + " disagrees with the whole input: " + difference, data);
+            }
+
+            prefix = ParseLive(data.substr(0, split), Simple::Details::ParseHeadersOnly);
+            if (prefix.outcome != Incompleted)
+            {
+                difference = Difference(prefix, headers);
+                if (!difference.empty())
+                    Fail("headers-only split at byte " + std::to_string(split) + " disagrees with the whole input: " + difference, data);
+            }
+        }
+    }
+
+    std::vector<std::string> Seeds()
+    {
+        return {
+            "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n",
+            "GET /index.html?x=1 HTTP/1.0\r\nConnection: Keep-Alive\r\nAccept: */*\r\n\r\n",
+            "POST /api/items HTTP/1.1\r\nHost: a\r\nContent-Type: application/json\r\nContent-Length: 13\r\n\r\n{\"name\":\"x\"}\n",
+            "PUT /r/1 HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n0\r\n\r\n",
+            "DELETE /r/1 HTTP/1.1\r\nX-Folded: a\r\n b\r\n\r\n",
+            "GET /legacy\r\n",
+            "OPTIONS * HTTP/1.1\r\nOrigin: https://a\r\nAccess-Control-Request-Method: PUT\r\n\r\n",
+            "PATCH /r/1 HTTP/1.1\r\nContent-Length: 0\r\n\r\n",
+            "HEAD / HTTP/1.0\r\n\r\n",
+        };
+    }
+
+    std::string Mutate(std::string data, const std::vector<std::string>& seeds, std::mt19937& random)
+    {
+        static const char interesting[] = { ' ', '\r', '\n', ':', '\t', '/', '0', '9', 'H', 'T', 'P', '.', 'a', 0, '\x7f', '\x80', '\xff' };
+        int mutations = 1 + random() % 4;
+        for (int m = 0; m < mutations; m++)
+        {
+            std::size_t position = data.empty() ? 0 : random() % (data.size() + 1);
+            switch (random() % 7)
+            {
+            case 0: // Flip a bit
+                if (!data.empty())
+                    data[position % data.size()] ^= static_cast<char>(1 << (random() % 8));
+                break;
+            case 1: // Insert an interesting byte
+                data.insert(data.begin() + position, interesting[random() % sizeof(interesting)]);
+                break;
+            case 2: // Replace with an interesting byte
+                if (!data.empty())
+                    data[position % data.size()] = interesting[random() % sizeof(interesting)];
+                break;
+            case 3: // Erase a range
+                data.erase(position, 1 + random() % 16);
+                break;
+            case 4: // Duplicate a range
+                if (!data.empty())
+                {
+                    std::size_t start = random() % data.size();
+                    data.insert(position, data.substr(start, 1 + random() % 32));
+                }
+                break;
+            case 5: // Splice in part of another seed
+            {
+                const std::string& other = seeds[random() % seeds.size()];
+                std::size_t start = random() % other.size();
+                data.insert(position, other.substr(start, 1 + random() % 64));
+                break;
+            }
+            default: // Truncate
+                data.resize(position);
+                break;
+            }
+        }
+        return data;
+    }
+
+    std::string ReadFile(const std::string& path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        std::ostringstream data;
+        data << file.rdbuf();
+        return data.str();
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    FuzzParser::CheckInput(std::string(reinterpret_cast<const char*>(data), size));
+    return 0;
+}
+
+#if !defined(SIMPLE_LIBFUZZER)
+int main(int argc, char** argv)
+{
+    using namespace FuzzParser;
+
+    uint64_t runs = 200000;
+    uint32_t seed = 1;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg.rfind("-runs=", 0) == 0)
+            runs = std::stoull(arg.substr(6));
+        else if (arg.rfind("-seed=", 0) == 0)
+            seed = static_cast<uint32_t>(std::stoul(arg.substr(6)));
+        else
+            files.push_back(arg);
+    }
+
+    if (!files.empty())
+    {
+        for (auto& file : files)
+            CheckInput(ReadFile(file));
+        std::cout << "FuzzParser: " << files.size() << " inputs passed\n";
+        return 0;
+    }
+
+    auto seeds = Seeds();
+    std::mt19937 random(seed);
+    for (auto& input : seeds)
+        CheckInput(input);
+    for (uint64_t i = 0; i < runs; i++)
+        CheckInput(Mutate(seeds[random() % seeds.size()], seeds, random));
+    std::cout << "FuzzParser: " << runs << " mutated inputs passed (seed " << seed << ")\n";
+    return 0;
+}
+#endif
@@ -0,0 +1,446 @@
+#pragma once
+
+// Frozen copy of Simple::Details::ParseRequest as of the hand-written state
+// machine. It is the oracle of the differential fuzzer: rewrites of the
+// live parser must keep producing the same results. Do not optimize.
+
+#include "SimpleHttpServer.hpp"
+
+namespace Reference {
+    using Simple::Request;
+
+    // Check if a byte is an HTTP character.
+    inline bool IsChar(int c)
+    {
+        return c >= 0 && c <= 127;
+    }
+
+    // Check if a byte is an HTTP control character.
+    inline bool IsControl(int c)
+    {
+        return (c >= 0 && c <= 31) || (c == 127);
+    }
+
+    // Check if a byte is defined as an HTTP special character.
+    inline bool IsSpecial(int c)
+    {
+        switch (c)
+        {
+        case '(': case ')': case '<': case '>': case '@':
+        case ',': case ';': case ':': case '\\': case '"':
+        case '/': case '[': case ']': case '?': case '=':
+        case '{': case '}': case ' ': case '\t':
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // Check if a byte is a digit.
+    inline bool IsDigit(int c)
+    {
+        return c >= '0' && c <= '9';
+    }
+
+    inline bool CheckIfConnection(const std::pair<std::string, std::string>& item)
+    {
+        return strcasecmp(item.first.c_str(), "Connection") == 0;
+    }
+
+    enum State
+    {
+        RequestMethodStart,
+        RequestMethod,
+        RequestUriStart,
+        RequestUri,
+        RequestHttpVersion_h,
+        RequestHttpVersion_ht,
+        RequestHttpVersion_htt,
+        RequestHttpVersion_http,
+        RequestHttpVersion_slash,
+        RequestHttpVersion_majorStart,
+        RequestHttpVersion_major,
+        RequestHttpVersion_minorStart,
+        RequestHttpVersion_minor,
+
+        ResponseStatusStart,
+        ResponseHttpVersion_ht,
+        ResponseHttpVersion_htt,
+        ResponseHttpVersion_http,
+        ResponseHttpVersion_slash,
+        ResponseHttpVersion_majorStart,
+        ResponseHttpVersion_major,
+        ResponseHttpVersion_minorStart,
+        ResponseHttpVersion_minor,
+        ResponseHttpVersion_spaceAfterVersion,
+        ResponseHttpVersion_statusCodeStart,
+        ResponseHttpVersion_spaceAfterStatusCode,
+        ResponseHttpVersion_statusTextStart,
+        ResponseHttpVersion_newLine,
+
+        HeaderLineStart,
+        HeaderLws,
+        HeaderName,
+        SpaceBeforeHeaderValue,
+        HeaderValue,
+        ExpectingNewline_2,
+        ExpectingNewline_3,
+
+        Post,
+    };
+
+    enum ParseResult
+    {
+        ParsingCompleted,
+        ParsingIncompleted,
+        ParsingError
+    };
+
+    inline ParseResult ParseRequest(const std::string& requestData, Request& req)
+    {
+        // Parser from https://github.com/nekipelov/httpparser
+        std::vector<std::pair<std::string, std::string>> headers;
+        std::vector<std::pair<std::string, std::string>> params;
+        State state = RequestMethodStart;
+        bool chunked = false;
+        size_t contentSize = 0;
+        
+        for (char input : requestData)
+        {
+            switch (state)
+            {
+            case RequestMethodStart:
+                if( !IsChar(input) || IsControl(input) || IsSpecial(input) )
+                {
+                    return ParsingError;
+                }
+                else
+                {
+                    state = RequestMethod;
+                    req.method.push_back(input);
+                }
+                break;
+            case RequestMethod:
+                if( input == ' ' )
+                {
+                    state = RequestUriStart;
+                }
+                else if( !IsChar(input) || IsControl(input) || IsSpecial(input) )
+                {
+                    return ParsingError;
+                }
+                else
+                {
+                    req.method.push_back(input);
+                }
+                break;
+            case RequestUriStart:
+                if( IsControl(input) )
+                {
+                    return ParsingError;
+                }
+                else
+                {
+                    state = RequestUri;
+                    req.path.push_back(input);
+                }
+                break;
+            case RequestUri:
+                if( input == ' ' )
+                {
+                    state = RequestHttpVersion_h;
+                }
+                else if (input == '\r')
+                {
+                    req.versionMajor = 0;
+                    req.versionMinor = 9;
+
+                    return ParsingCompleted;
+                }
+                else if( IsControl(input) )
+                {
+                    return ParsingError;
+                }
+                else
+                {
+                    req.path.push_back(input);
+                }
+                break;
+            case RequestHttpVersion_h:
+                if( input == 'H' )
+                {
+                    state = RequestHttpVersion_ht;
+                }
+                else
+                {
+                    return ParsingError;
+                }
+                break;
+            case RequestHttpVersion_ht:
+                if( input == 'T' )
+                {
+                    state = RequestHttpVersion_htt;
+                }
+                else
+                {
+                    return ParsingError;
+                }
+                break;
+            case RequestHttpVersion_htt:
+                if( input == 'T' )
+                {
+                    state = RequestHttpVersion_http;
+                }
+                else
+                {
+                    return ParsingError;
+                }
+                break;
+            case RequestHttpVersion_http:
+                if( input == 'P' )
+                {
+                    state = RequestHttpVersion_slash;
+                }
+                else
+                {
+                    return ParsingError;
+                }
+                break;
+            case RequestHttpVersion_slash:
+                if( input == '/' )
+                {
+                    req.versionMajor = 0;
+                    req.versionMinor = 0;
+                    state = RequestHttpVersion_majorStart;
+                }
+                else
+                {
+                    return ParsingError;
+                }
+                break;
+            case RequestHttpVersion_majorStart:
+                if( IsDigit(input) )
+                {
+                    req.versionMajor = input - '0';
+                    state = RequestHttpVersion_major;
+                }
+                else
+                {
+                    return ParsingError;
+                }
+                break;
+            case RequestHttpVersion_major:
+                if( input == '.' )
+                {
+                    state = RequestHttpVersion_minorStart;
+                }
+                else if (IsDigit(input))
+                {
+                    req.versionMajor = req.versionMajor * 10 + input - '0';
+                }
+                else
+                {
+                    return ParsingError;
+                }
+                break;
+            case RequestHttpVersion_minorStart:
+                if( IsDigit(input) )
+                {
+                    req.versionMinor = input - '0';
+                    state = RequestHttpVersion_minor;
+                }
+                else
+                {
+                    return ParsingError;
+                }
+                break;
+            case RequestHttpVersion_minor:
+                if( input == '\r' )
+                {
+                    state = ResponseHttpVersion_newLine;
+                }
+                else if( IsDigit(input) )
+                {
+                    req.versionMinor = req.versionMinor * 10 + input - '0';
+                }
+                else
+                {
+                    return ParsingError;
+                }
+                break;
+            case ResponseHttpVersion_newLine:
+                if( input == '\n' )
+                {
+                    state = HeaderLineStart;
+                }
+                else
+                {
+                    return ParsingError;
+                }
+                break;
+            case HeaderLineStart:
+                if( input == '\r' )
+                {
+                    state = ExpectingNewline_3;
+                }
+                else if( !req.headers.empty() && (input == ' ' || input == '\t') )
+                {
+                    state = HeaderLws;
+                }
+                else if( !IsChar(input) || IsControl(input) || IsSpecial(input) )
+                {
+                    return ParsingError;
+                }
+                else
+                {
+                    headers.push_back({});
+                    headers.back().first.reserve(16);
+                    headers.back().second.reserve(16);
+                    headers.back().first.push_back(input);
+                    state = HeaderName;
+                }
+                break;
+            case HeaderLws:
+                if( input == '\r' )
+                {
+                    state = ExpectingNewline_2;
+                }
+                else if( input == ' ' || input == '\t' )
+                {
+                }
+                else if( IsControl(input) )
+                {
+                    return ParsingError;
+                }
+                else
+                {
+                    state = HeaderValue;
+                    headers.back().second.push_back(input);
+                }
+                break;
+            case HeaderName:
+                if( input == ':' )
+                {
+                    state = SpaceBeforeHeaderValue;
+                }
+                else if( !IsChar(input) || IsControl(input) || IsSpecial(input) )
+                {
+                    return ParsingError;
+                }
+                else
+                {
+                    headers.back().first.push_back(input);
+                }
+                break;
+            case SpaceBeforeHeaderValue:
+                if( input == ' ' )
+                {
+                    state = HeaderValue;
+                }
+                else
+                {
+                    return ParsingError;
+                }
+                break;
+            case HeaderValue:
+                if( input == '\r' )
+                {
+                    if( req.method == "POST" || req.method == "PUT" )
+                    {
+                        auto &h = headers.back();
+
+                        if( strcasecmp(h.first.c_str(), "Content-Length") == 0 )
+                        {
+                            contentSize = atoi(h.second.c_str());
+                            req.body.reserve( contentSize );
+                            req.contentLength = contentSize;
+                        }
+                        else if( strcasecmp(h.first.c_str(), "Transfer-Encoding") == 0 )
+                        {
+                            if(strcasecmp(h.second.c_str(), "chunked") == 0)
+                                chunked = true;
+                        }
+                    }
+                    state = ExpectingNewline_2;
+                }
+                else if( IsControl(input) )
+                {
+                    return ParsingError;
+                }
+                else
+                {
+                    headers.back().second.push_back(input);
+                }
+                break;
+            case ExpectingNewline_2:
+                if( input == '\n' )
+                {
+                    state = HeaderLineStart;
+                }
+                else
+                {
+                    return ParsingError;
+                }
+                break;
+            case ExpectingNewline_3: {
+                std::vector<std::pair<std::string, std::string>>::iterator it = std::find_if(headers.begin(),
+                                                                    headers.end(),
+                                                                    CheckIfConnection);
+
+                if( it != headers.end() )
+                {
+                    if( strcasecmp(it->second.c_str(), "Keep-Alive") == 0 )
+                    {
+                        // req.keepAlive = true;
+                    }
+                    else  // == Close
+                    {
+                        // req.keepAlive = false;
+                    }
+                }
+                else
+                {
+                    // if( req.versionMajor > 1 || (req.versionMajor == 1 && req.versionMinor == 1) )
+                    //     req.keepAlive = true;
+                }
+
+                if( chunked )
+                {
+                }
+                else if( contentSize == 0 )
+                {
+                    if( input == '\n')
+                    {
+                        for (auto& [name, value] : headers)
+                            req.headers[name] = std::move(value);
+                        for (auto& [name, value] : params)
+                            req.params[name] = std::move(value);
+                        return ParsingCompleted;
+                    }
+                    else
+                        return ParsingError;
+                }
+                else
+                {
+                    state = Post;
+                }
+                break;
+            }
+            case Post:
+                if (true)
+                {
+                    for (auto& [name, value] : headers)
+                        req.headers[name] = std::move(value);
+                    for (auto& [name, value] : params)
+                        req.params[name] = std::move(value);
+                }
+                return ParsingCompleted;
+                break;
+            default:
+                return ParsingError;
+            }
+        }
+
+        return ParsingIncompleted;
+    }
+}
@@ -1,3 +1,13 @@
+newoption {
+    trigger = "fuzzer",
+    description = "Build FuzzParser as a libFuzzer target (clang only)"
+}
+
+newoption {
+    trigger = "io_uring",
+    description = "Use asio's io_uring backend with registered buffers (Linux, needs liburing)"
+}
+
 workspace "SimpleHttpServerWorkspace"
     configurations { "Debug", "Release" }
 
@@ -21,9 +31,98 @@ project "SimpleHttpServer"
 	filter "system:linux"
 		pic "On"
 		systemversion "latest"
+		defines { "SIMPLE_HTTP_ZLIB", "SIMPLE_HTTP_TLS" }
+		links
+		{
+			"pthread",
+			"z",
+			"ssl",
+			"crypto",
+		}
+	filter "system:windows"
+		systemversion "latest"
+		links
+		{
+		}
+
+    filter { "system:linux", "options:io_uring" }
+        defines { "ASIO_HAS_IO_URING", "ASIO_DISABLE_EPOLL" }
+        links { "uring" }
+
+    filter { "configurations:Debug" }
+        defines { "DEBUG" }
+        symbols "On"
+
+    filter { "configurations:Release" }
+        defines { "NDEBUG" }
+        optimize "On"
+
+project "LoadGenerator"
+	kind "ConsoleApp"
+	language "C++"
+	cppdialect "C++17"
+	staticruntime "on"
+    files { "./bench/LoadGenerator.cpp" }
+
+	targetdir ("%{wks.location}/bin/" .. outputdir .. "/%{prj.name}")
+	objdir ("%{wks.location}/bin-int/" .. outputdir .. "/%{prj.name}")
+
+	includedirs
+	{
+        "./src/",
+        "./asio/"
+    }
+
+	filter "system:linux"
+		pic "On"
+		systemversion "latest"
+		links
+		{
+			"pthread",
+		}
+	filter "system:windows"
+		systemversion "latest"
+		links
+		{
+		}
+
+    filter { "system:linux", "options:io_uring" }
+        defines { "ASIO_HAS_IO_URING", "ASIO_DISABLE_EPOLL" }
+        links { "uring" }
+
+    filter { "configurations:Debug" }
+        defines { "DEBUG" }
+        symbols "On"
+
+    filter { "configurations:Release" }
+        defines { "NDEBUG" }
+        optimize "On"
+
+
+project "MicroBench"
+	kind "ConsoleApp"
+	language "C++"
+	cppdialect "C++17"
+	staticruntime "on"
+    files { "./bench/MicroBench.cpp" }
+
+	targetdir ("%{wks.location}/bin/" .. outputdir .. "/%{prj.name}")
+	objdir ("%{wks.location}/bin-int/" .. outputdir .. "/%{prj.name}")
+
+	includedirs
+	{
+        "./src/",
+        "./asio/"
+    }
+
+	filter "system:linux"
+		pic "On"
+		systemversion "latest"
+		defines { "SIMPLE_HTTP_ZLIB" }
 		links
 		{
 			"pthread",
+			"z",
 		}
 	filter "system:windows"
 		systemversion "latest"
@@ -35,6 +134,50 @@ project "SimpleHttpServer"
         defines { "DEBUG" }
         symbols "On"
 
+    filter { "configurations:Release" }
+        defines { "NDEBUG" }
+        optimize "On"
+
+
+project "FuzzParser"
+	kind "ConsoleApp"
+	language "C++"
+	cppdialect "C++17"
+	staticruntime "on"
+    files { "./fuzz/**.hpp", "./fuzz/**.cpp" }
+
+	targetdir ("%{wks.location}/bin/" .. outputdir .. "/%{prj.name}")
+	objdir ("%{wks.location}/bin-int/" .. outputdir .. "/%{prj.name}")
+
+	includedirs
+	{
+        "./src/",
+        "./asio/"
+    }
+
+	filter "system:linux"
+		pic "On"
+		systemversion "latest"
+		links
+		{
+			"pthread",
+		}
+	filter "system:windows"
+		systemversion "latest"
+		links
+		{
+		}
+
+    filter { "options:fuzzer" }
+        toolset "clang"
+        defines { "SIMPLE_LIBFUZZER" }
+        buildoptions { "-fsanitize=fuzzer,address,undefined" }
+        linkoptions { "-fsanitize=fuzzer,address,undefined" }
+
+    filter { "configurations:Debug" }
+        defines { "DEBUG" }
+        symbols "On"
+
     filter { "configurations:Release" }
         defines { "NDEBUG" }
         optimize "On"
\ No newline at end of file
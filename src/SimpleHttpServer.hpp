@@ -8,26 +8,109 @@
 #include <iostream>
 #include <vector>
 #include <iomanip>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <array>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <csignal>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <optional>
+#include <new>
+#include <filesystem>
 
 #include <asio.hpp>
 
+#if defined(SIMPLE_HTTP_ZLIB)
+#include <zlib.h>
+#endif
+
+#if defined(SIMPLE_HTTP_TLS)
+#include <asio/ssl.hpp>
+#endif
+
+// Registered buffers only pay off with io_uring, the code path itself
+// builds with any backend.
+#if defined(ASIO_HAS_IO_URING) && !defined(SIMPLE_HTTP_REGISTERED_BUFFERS)
+#define SIMPLE_HTTP_REGISTERED_BUFFERS
+#endif
+
+// Handing listening sockets to another process takes POSIX descriptors
+// and SCM_RIGHTS. asio also has Unix domain sockets on Windows.
+#if defined(ASIO_HAS_LOCAL_SOCKETS) && !defined(_WIN32) && !defined(SIMPLE_HTTP_LISTENER_HANDOFF)
+#define SIMPLE_HTTP_LISTENER_HANDOFF
+#endif
+
+#if defined(SIMPLE_HTTP_LISTENER_HANDOFF)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
 namespace Simple {
-    namespace Details { class RequestSession; }
+    namespace Details
+    {
+        class Session;
+        template<typename Stream> class RequestSession;
+        class Listener;
+        template<typename Protocol> class SocketListener;
+    }
 
     typedef std::unordered_map<std::string, std::string> Headers;
     typedef std::unordered_map<std::string, std::string> Params;
 
+    enum class Method : uint8_t
+    {
+        Get,
+        Head,
+        Post,
+        Put,
+        Delete,
+        Options,
+        Patch,
+        Connect,
+        Trace,
+        Unknown // Any other token, routes can't be registered for it
+    };
+
+    constexpr std::size_t MethodCount = static_cast<std::size_t>(Method::Unknown);
+
+    constexpr std::string_view MethodName(Method method)
+    {
+        switch (method)
+        {
+        case Method::Get: return "GET";
+        case Method::Head: return "HEAD";
+        case Method::Post: return "POST";
+        case Method::Put: return "PUT";
+        case Method::Delete: return "DELETE";
+        case Method::Options: return "OPTIONS";
+        case Method::Patch: return "PATCH";
+        case Method::Connect: return "CONNECT";
+        case Method::Trace: return "TRACE";
+        default: return "";
+        }
+    }
+
     struct Request
     {
         std::string method;
+        Method methodType = Method::Unknown; // method classified by the parser
         std::string path; 
         std::string body; 
         std::string remote_addr;
         std::string version;
         std::string target;
-        int versionMajor;
-        int versionMinor;
-        uint32_t contentLength;
+        int versionMajor = 0;
+        int versionMinor = 0;
+        uint32_t contentLength = 0;
         Headers headers;
         Params params;
     };
@@ -57,304 +140,2511 @@ namespace Simple {
         Headers headers;
     };
 
-    typedef std::function<void(const Request&, Response&)> CallbackHandler;
-    typedef std::function<void(const Request&, Response&, std::function<void()>)> CallbackMiddlewareHandler;
-    typedef std::pair<std::string, CallbackHandler> Handler;
-    typedef std::pair<std::string, CallbackMiddlewareHandler> MiddlewareHandler;
+    // Move-only replacement of std::function without RTTI. Callables of up
+    // to Capacity bytes are stored inside the object, larger ones or ones
+    // that may throw when moved live on the heap. Calling it is one
+    // indirect call; calling an empty Function throws std::bad_function_call.
+    template<typename Signature, std::size_t Capacity = 48>
+    class Function;
 
-    class HttpServer
+    template<typename Result, typename... Args, std::size_t Capacity>
+    class Function<Result(Args...), Capacity>
     {
     public:
-        HttpServer(const std::string& address, uint_least16_t port);
-        ~HttpServer();
-        void Start();
-        void Get(const std::string& pathPattern, CallbackHandler requestHandler);
-        void Post(const std::string& pathPattern, CallbackHandler requestHandler);
-        void Put(const std::string& pathPattern, CallbackHandler requestHandler);
-        void Delete(const std::string& pathPattern, CallbackHandler requestHandler);
+        Function() noexcept = default;
+        Function(std::nullptr_t) noexcept {}
+
+        template<typename Callable, typename = std::enable_if_t<
+            !std::is_same_v<std::decay_t<Callable>, Function> &&
+            std::is_invocable_r_v<Result, std::decay_t<Callable>&, Args...>>>
+        Function(Callable&& callable)
+        {
+            typedef std::decay_t<Callable> Target;
+            if constexpr (std::is_pointer_v<Target> || std::is_member_pointer_v<Target>)
+                if (callable == nullptr)
+                    return;
+
+            if constexpr (IsInline<Target>())
+            {
+                new (m_Storage) Target(std::forward<Callable>(callable));
+                m_Invoke = &InvokeInline<Target>;
+                m_Manage = &ManageInline<Target>;
+            }
+            else
+            {
+                *reinterpret_cast<Target**>(m_Storage) = new Target(std::forward<Callable>(callable));
+                m_Invoke = &InvokeHeap<Target>;
+                m_Manage = &ManageHeap<Target>;
+            }
+        }
+
+        Function(Function&& other) noexcept
+        {
+            MoveFrom(other);
+        }
+
+        Function& operator=(Function&& other) noexcept
+        {
+            if (this != &other)
+            {
+                Reset();
+                MoveFrom(other);
+            }
+            return *this;
+        }
+
+        Function& operator=(std::nullptr_t) noexcept
+        {
+            Reset();
+            return *this;
+        }
+
+        Function(const Function&) = delete;
+        Function& operator=(const Function&) = delete;
+
+        ~Function()
+        {
+            Reset();
+        }
+
+        Result operator()(Args... args) const
+        {
+            return m_Invoke(const_cast<unsigned char*>(m_Storage), std::forward<Args>(args)...);
+        }
+
+        explicit operator bool() const noexcept { return m_Manage != nullptr; }
+
+    private:
+        typedef Result (*Invoker)(void* storage, Args&&... args);
+        // Moves the callable from storage to target and destroys the
+        // original. Destroys it only when target is null.
+        typedef void (*Manager)(void* storage, void* target) noexcept;
+
+        template<typename Target>
+        static constexpr bool IsInline()
+        {
+            return sizeof(Target) <= Capacity && alignof(Target) <= alignof(std::max_align_t) &&
+                std::is_nothrow_move_constructible_v<Target>;
+        }
+
+        template<typename Target>
+        static Result InvokeInline(void* storage, Args&&... args)
+        {
+            return std::invoke(*static_cast<Target*>(storage), std::forward<Args>(args)...);
+        }
+
+        template<typename Target>
+        static void ManageInline(void* storage, void* target) noexcept
+        {
+            auto* callable = static_cast<Target*>(storage);
+            if (target)
+                new (target) Target(std::move(*callable));
+            callable->~Target();
+        }
+
+        template<typename Target>
+        static Result InvokeHeap(void* storage, Args&&... args)
+        {
+            return std::invoke(**static_cast<Target**>(storage), std::forward<Args>(args)...);
+        }
+
+        template<typename Target>
+        static void ManageHeap(void* storage, void* target) noexcept
+        {
+            auto** callable = static_cast<Target**>(storage);
+            if (target)
+                *static_cast<Target**>(target) = *callable;
+            else
+                delete *callable;
+        }
+
+        static Result InvokeEmpty(void*, Args&&...)
+        {
+            throw std::bad_function_call();
+        }
+
+        void MoveFrom(Function& other) noexcept
+        {
+            if (!other.m_Manage)
+                return;
+            other.m_Manage(other.m_Storage, m_Storage);
+            m_Invoke = other.m_Invoke;
+            m_Manage = other.m_Manage;
+            other.m_Invoke = &InvokeEmpty;
+            other.m_Manage = nullptr;
+        }
+
+        void Reset() noexcept
+        {
+            if (!m_Manage)
+                return;
+            m_Manage(m_Storage, nullptr);
+            m_Invoke = &InvokeEmpty;
+            m_Manage = nullptr;
+        }
+
+    private:
+        Invoker m_Invoke = &InvokeEmpty;
+        Manager m_Manage = nullptr;
+        alignas(std::max_align_t) unsigned char m_Storage[Capacity];
+    };
+
+    // Completes a request outside of its handler. Obtained through a
+    // DeferredCallbackHandler, it can be moved to any thread and Send
+    // called later; the session waits without holding any thread.
+    // A Responder destroyed without sending answers 500.
+    class Responder
+    {
+    public:
+        Responder() = default;
+        Responder(Responder&& other) noexcept = default;
+        Responder& operator=(Responder&& other) noexcept;
+        Responder(const Responder&) = delete;
+        Responder& operator=(const Responder&) = delete;
+        ~Responder();
+
+        void Send(Response response);
+        explicit operator bool() const { return m_Session != nullptr; }
 
     private:
-        void DoAccept();
+        explicit Responder(std::shared_ptr<Details::Session> session) :
+            m_Session(std::move(session))
+        {
+        }
 
     private:
-        asio::io_context m_IoContext;
-        asio::ip::tcp::acceptor m_Acceptor;
+        std::shared_ptr<Details::Session> m_Session;
 
-        std::vector<Handler> m_GetHandlers;
-        std::vector<Handler> m_PostHandlers;
-        std::vector<Handler> m_PutHandlers;
-        std::vector<Handler> m_DeleteHandlers;
-        std::vector<MiddlewareHandler> m_Middlewares;
-        std::shared_ptr<std::thread> m_ContextThread;
+        template<typename Stream> friend class Details::RequestSession;
+    };
+
+    typedef Function<void(const Request&, Response&)> CallbackHandler;
+    typedef Function<void(const Request&, Responder)> DeferredCallbackHandler;
+    typedef Function<void(const Request&, Response&, Function<void()>)> CallbackMiddlewareHandler;
+    typedef std::pair<std::string, CallbackMiddlewareHandler> MiddlewareHandler;
+
+    // Latency distribution of one request phase, in nanoseconds.
+    struct PhaseSummary
+    {
+        std::string name;
+        uint64_t count = 0;
+        double mean = 0;
+        uint64_t p50 = 0;
+        uint64_t p90 = 0;
+        uint64_t p99 = 0;
+        uint64_t p999 = 0;
+        uint64_t max = 0;
+    };
+
+    enum class AccessLogFormat
+    {
+        Common,   // NCSA Common Log Format
+        Combined, // Common plus referer and user agent
+        Json      // One JSON object per line
+    };
+
+    struct AccessLogOptions
+    {
+        std::string path = "access.log"; // "-" writes to stdout
+        AccessLogFormat format = AccessLogFormat::Combined;
+        std::size_t ringCapacity = 4096; // Records buffered per thread, rounded up to a power of two
+        int reopenSignal = SIGHUP;       // Reopens the file after rotation, 0 disables it
+    };
+
+    // Request limits and connection reuse. Requests over a limit are
+    // answered with the matching error and the connection is closed.
+    struct ServerLimits
+    {
+        std::size_t maxHeaderSize = 16 * 1024;     // Request line and headers, 431 beyond (414 if the request line alone is longer)
+        std::size_t maxUriLength = 8 * 1024;       // 414 beyond
+        std::size_t maxBodySize = 8 * 1024 * 1024; // 413 beyond
+        std::chrono::milliseconds keepAliveTimeout = std::chrono::seconds(5); // Idle time before closing, 0 disables keep-alive
+        std::size_t maxKeepAliveRequests = 1000;   // Requests served on one connection
+        std::chrono::milliseconds handshakeTimeout = std::chrono::seconds(10); // TLS handshake and close_notify exchange
+        // Reading the headers and body of a request from its first byte.
+        // The first request of a connection also counts the wait for it.
+        std::chrono::milliseconds requestTimeout = std::chrono::seconds(30);
+    };
+
+    // Settings of the connections accepted by a listener. Sizes of 0 keep
+    // the system defaults; on TCP the buffer sizes are set on the listening
+    // socket, which the connections inherit, so they count for the window
+    // scale. Per connection settings the system refuses are skipped.
+    struct SocketOptions
+    {
+        bool noDelay = true;    // TCP_NODELAY: responses are not held back by Nagle's algorithm
+        int receiveBuffer = 0;  // SO_RCVBUF, fixing it disables the kernel's autotuning
+        int sendBuffer = 0;     // SO_SNDBUF
+        bool quickAck = false;  // TCP_QUICKACK, Linux: no delayed ACK at the start of the connection
+        std::chrono::microseconds busyPoll = std::chrono::microseconds(0); // SO_BUSY_POLL, Linux: spin on the device queue when reading
+    };
+
+    // Acceptor settings of one listener.
+    struct ListenOptions
+    {
+        int backlog = asio::socket_base::max_listen_connections;
+        bool v6Only = false; // An IPv6 wildcard address ("::") accepts IPv4 too unless set
+        std::chrono::seconds deferAccept = std::chrono::seconds(0); // TCP_DEFER_ACCEPT, Linux: accepted once data arrives, up to this long
+        int fastOpenQueue = 0; // TCP_FASTOPEN pending requests, Linux; 0 leaves it off
+        std::size_t acceptBatch = 64; // Connections accepted per wakeup of the listener
+        SocketOptions socket;
+    };
+
+    // How listeners spread the accepted connections over the worker threads.
+    enum class ConnectionBalancing
+    {
+        RoundRobin,
+        LeastConnections // Fewest open connections
+    };
+
+#if defined(SIMPLE_HTTP_TLS)
+    // Certificate and session settings of a TLS listener.
+    struct TlsOptions
+    {
+        std::string certificateChainFile; // PEM, leaf certificate first
+        std::string privateKeyFile;       // PEM
+        std::vector<std::string> alpn = { "http/1.1" }; // Protocols selected through ALPN, in order of preference
+        bool sessionTickets = true;           // Stateless resumption
+        std::size_t sessionCacheSize = 20480; // Sessions cached for resumption by ID, 0 disables the cache
+        std::chrono::seconds sessionTimeout = std::chrono::seconds(300);
+    };
+#endif
+
+#if defined(SIMPLE_HTTP_ZLIB)
+    // Response compression, negotiated through Accept-Encoding.
+    struct CompressionOptions
+    {
+        int level = 6;              // zlib level, 1 (fastest) to 9 (smallest)
+        std::size_t minSize = 1024; // Smaller bodies are sent as they are
+        bool gzip = true;
+        bool deflate = true;
+        // Content-Type prefixes that are compressed already
+        std::vector<std::string> skipContentTypes = {
+            "image/png", "image/jpeg", "image/gif", "image/webp", "image/avif", "video/", "audio/", "font/woff",
+            "application/zip", "application/gzip", "application/x-gzip", "application/zstd", "application/octet-stream"
+        };
+    };
+#endif
+
+    // Cross-origin resource sharing. Preflights are answered by the
+    // server from the route table, handlers never see them.
+    struct CorsOptions
+    {
+        std::vector<std::string> allowOrigins;              // "*" allows any origin
+        std::string allowHeaders = "Content-Type, Authorization";
+        unsigned maxAge = 600;                               // Seconds a preflight may be cached
+        bool allowCredentials = false;
+    };
+
+    // Micro-caching of a GET route and its HEAD fallback. Responses are
+    // kept serialized for ttl under the method, the target and the vary
+    // request headers. On a miss one request runs the handler and the
+    // concurrent ones wait for its response.
+    struct CacheOptions
+    {
+        std::chrono::milliseconds ttl{0}; // 0 disables the cache
+        // Past ttl, one request refreshes the entry while the others are
+        // still served the stale response.
+        std::chrono::milliseconds staleWhileRevalidate{0};
+        // Request headers the response depends on. Accept-Encoding and
+        // Origin are added when compression or CORS are enabled. Requests
+        // with Authorization or Cookie bypass the cache unless the header
+        // is listed here (RFC 9111 3.5).
+        std::vector<std::string> vary;
+    };
+
+    struct ResponseCacheStats
+    {
+        uint64_t hits = 0;
+        uint64_t staleHits = 0; // Served while another request refreshes
+        uint64_t misses = 0;    // Requests the cache couldn't answer
+        uint64_t evictions = 0;
+        std::size_t entries = 0;
+        std::size_t bytes = 0;
+    };
 
-        friend class Details::RequestSession;
+    // Concurrent GET and HEAD requests with the same method, target and
+    // vary request headers run the handler once and share its response.
+    // Nothing is kept once it is sent.
+    struct CoalesceOptions
+    {
+        bool enabled = false;
+        // As CacheOptions::vary, requests with Authorization or Cookie are
+        // not coalesced unless the header is listed.
+        std::vector<std::string> vary;
+    };
+
+    struct CoalescingStats
+    {
+        uint64_t leaders = 0;   // Requests that ran the handler for a key
+        uint64_t coalesced = 0; // Requests that waited for a leader's response
+    };
+
+    struct RouteOptions
+    {
+        // Run the handler on the offload pool instead of the io thread.
+        // Use it for CPU-heavy or blocking handlers.
+        bool offload = false;
+        CacheOptions cache;
+        // Routes with a cache coalesce their misses on the cache key.
+        CoalesceOptions coalesce;
+    };
+
+    // Routes are matched by scanning a vector of handlers. Every entry
+    // starts on its own cache line with the path the scan compares. The
+    // callback follows it and runs into the second line, the options
+    // take the lines after.
+    struct alignas(64) Handler
+    {
+        std::string path;
+        CallbackHandler callback;
+        DeferredCallbackHandler deferredCallback;
+        RouteOptions options;
+        std::size_t id = 0; // Index of the route in the metrics
     };
 
     namespace Details
     {
-        inline const char* StatusMessage(uint16_t status) {
-            switch (status) {
-            case 100: return "Continue";
-            case 101: return "Switching Protocol";
-            case 102: return "Processing";
-            case 103: return "Early Hints";
-            case 200: return "OK";
-            case 201: return "Created";
-            case 202: return "Accepted";
-            case 203: return "Non-Authoritative Information";
-            case 204: return "No Content";
-            case 205: return "Reset Content";
-            case 206: return "Partial Content";
-            case 207: return "Multi-Status";
-            case 208: return "Already Reported";
-            case 226: return "IM Used";
-            case 300: return "Multiple Choice";
-            case 301: return "Moved Permanently";
-            case 302: return "Found";
-            case 303: return "See Other";
-            case 304: return "Not Modified";
-            case 305: return "Use Proxy";
-            case 306: return "unused";
-            case 307: return "Temporary Redirect";
-            case 308: return "Permanent Redirect";
-            case 400: return "Bad Request";
-            case 401: return "Unauthorized";
-            case 402: return "Payment Required";
-            case 403: return "Forbidden";
-            case 404: return "Not Found";
-            case 405: return "Method Not Allowed";
-            case 406: return "Not Acceptable";
-            case 407: return "Proxy Authentication Required";
-            case 408: return "Request Timeout";
-            case 409: return "Conflict";
-            case 410: return "Gone";
-            case 411: return "Length Required";
-            case 412: return "Precondition Failed";
-            case 413: return "Payload Too Large";
-            case 414: return "URI Too Long";
-            case 415: return "Unsupported Media Type";
-            case 416: return "Range Not Satisfiable";
-            case 417: return "Expectation Failed";
-            case 418: return "I'm a teapot";
-            case 421: return "Misdirected Request";
-            case 422: return "Unprocessable Entity";
-            case 423: return "Locked";
-            case 424: return "Failed Dependency";
-            case 425: return "Too Early";
-            case 426: return "Upgrade Required";
-            case 428: return "Precondition Required";
-            case 429: return "Too Many Requests";
-            case 431: return "Request Header Fields Too Large";
-            case 451: return "Unavailable For Legal Reasons";
-            case 501: return "Not Implemented";
-            case 502: return "Bad Gateway";
-            case 503: return "Service Unavailable";
-            case 504: return "Gateway Timeout";
-            case 505: return "HTTP Version Not Supported";
-            case 506: return "Variant Also Negotiates";
-            case 507: return "Insufficient Storage";
-            case 508: return "Loop Detected";
-            case 510: return "Not Extended";
-            case 511: return "Network Authentication Required";
+        constexpr uint64_t MixHash(uint64_t hash)
+        {
+            hash ^= hash >> 33;
+            hash *= 0xff51afd7ed558ccdull;
+            hash ^= hash >> 33;
+            hash *= 0xc4ceb9fe1a85ec53ull;
+            return hash ^ (hash >> 33);
+        }
 
-            default:
-            case 500: return "Internal Server Error";
+        // Little endian word of the eight bytes at data. Constant
+        // evaluation assembles it byte by byte, at run time it is one load.
+        constexpr uint64_t LoadWord(const char* data)
+        {
+#if (defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) || (defined(_MSC_VER) && _MSC_VER >= 1925)
+            if (!__builtin_is_constant_evaluated())
+            {
+                uint64_t word = 0;
+                std::memcpy(&word, data, sizeof(word));
+                return word;
             }
+#endif
+            uint64_t word = 0;
+            for (std::size_t b = 0; b < 8; b++)
+                word |= uint64_t(static_cast<uint8_t>(data[b])) << (8 * b);
+            return word;
         }
 
-        constexpr auto END_TOKEN = "\r\n\r\n"; 
-        // Check if a byte is an HTTP character.
-        inline bool IsChar(int c)
+        constexpr uint64_t MethodWord(std::string_view name)
         {
-            return c >= 0 && c <= 127;
+            uint64_t word = 0;
+            for (std::size_t b = 0; b < name.size() && b < 8; b++)
+                word |= uint64_t(static_cast<uint8_t>(name[b])) << (8 * b);
+            return word;
         }
 
-        // Check if a byte is an HTTP control character.
-        inline bool IsControl(int c)
+        // Classifies a method token with one word compare per candidate.
+        inline Method ParseMethod(std::string_view name)
         {
-            return (c >= 0 && c <= 31) || (c == 127);
+            if (name.empty() || name.size() > 7)
+                return Method::Unknown;
+
+            char padded[8] = {};
+            std::memcpy(padded, name.data(), name.size());
+            switch (LoadWord(padded))
+            {
+            case MethodWord("GET"): return Method::Get;
+            case MethodWord("HEAD"): return Method::Head;
+            case MethodWord("POST"): return Method::Post;
+            case MethodWord("PUT"): return Method::Put;
+            case MethodWord("DELETE"): return Method::Delete;
+            case MethodWord("OPTIONS"): return Method::Options;
+            case MethodWord("PATCH"): return Method::Patch;
+            case MethodWord("CONNECT"): return Method::Connect;
+            case MethodWord("TRACE"): return Method::Trace;
+            default: return Method::Unknown;
+            }
         }
 
-        // Check if a byte is defined as an HTTP special character.
-        inline bool IsSpecial(int c)
+        // Hashes eight bytes per step, usable in constant expressions.
+        constexpr uint64_t HashBytes(uint64_t hash, std::string_view data)
         {
-            switch (c)
+            std::size_t i = 0;
+            for (; i + 8 <= data.size(); i += 8)
             {
-            case '(': case ')': case '<': case '>': case '@':
-            case ',': case ';': case ':': case '\\': case '"':
-            case '/': case '[': case ']': case '?': case '=':
-            case '{': case '}': case ' ': case '\t':
-                return true;
-            default:
-                return false;
+                hash = (hash ^ LoadWord(data.data() + i)) * 0x9e3779b97f4a7c15ull;
+                hash ^= hash >> 32;
             }
+            // The last eight bytes, overlapping the ones already hashed
+            uint64_t tail = uint64_t(data.size()) << 56;
+            if (i < data.size() && data.size() >= 8)
+                tail ^= LoadWord(data.data() + data.size() - 8);
+            else
+                for (std::size_t b = 0; i + b < data.size(); b++)
+                    tail |= uint64_t(static_cast<uint8_t>(data[i + b])) << (8 * b);
+            hash = (hash ^ tail) * 0x9e3779b97f4a7c15ull;
+            return hash ^ (hash >> 32);
         }
 
-        // Check if a byte is a digit.
-        inline bool IsDigit(int c)
+        constexpr uint64_t RouteHash(uint64_t seed, std::string_view method, std::string_view path)
         {
-            return c >= '0' && c <= '9';
+            return HashBytes(HashBytes(MixHash(seed), method), path);
         }
 
-        inline bool CheckIfConnection(const std::pair<std::string, std::string>& item)
+        // Top bits of the displaced hash, the bucket uses the low ones.
+        constexpr std::size_t RouteSlot(uint64_t hash, uint16_t displacement, std::size_t mask)
         {
-            return strcasecmp(item.first.c_str(), "Connection") == 0;
+            return ((hash ^ (displacement * 0x9e3779b97f4a7c15ull)) * 0xff51afd7ed558ccdull) >> 48 & mask;
         }
 
-        // The current state of the parser.
-        enum State
+        template<typename Route, typename = void>
+        struct RouteMethodOf
         {
-            RequestMethodStart,
-            RequestMethod,
-            RequestUriStart,
-            RequestUri,
-            RequestHttpVersion_h,
-            RequestHttpVersion_ht,
-            RequestHttpVersion_htt,
-            RequestHttpVersion_http,
-            RequestHttpVersion_slash,
-            RequestHttpVersion_majorStart,
-            RequestHttpVersion_major,
-            RequestHttpVersion_minorStart,
-            RequestHttpVersion_minor,
+            static constexpr std::string_view value = "GET";
+        };
 
-            ResponseStatusStart,
-            ResponseHttpVersion_ht,
-            ResponseHttpVersion_htt,
-            ResponseHttpVersion_http,
-            ResponseHttpVersion_slash,
-            ResponseHttpVersion_majorStart,
-            ResponseHttpVersion_major,
-            ResponseHttpVersion_minorStart,
-            ResponseHttpVersion_minor,
-            ResponseHttpVersion_spaceAfterVersion,
-            ResponseHttpVersion_statusCodeStart,
-            ResponseHttpVersion_spaceAfterStatusCode,
-            ResponseHttpVersion_statusTextStart,
-            ResponseHttpVersion_newLine,
-
-            HeaderLineStart,
-            HeaderLws,
-            HeaderName,
-            SpaceBeforeHeaderValue,
-            HeaderValue,
-            ExpectingNewline_2,
-            ExpectingNewline_3,
-
-            Post,
+        template<typename Route>
+        struct RouteMethodOf<Route, std::void_t<decltype(Route::method)>>
+        {
+            static constexpr std::string_view value = Route::method;
         };
 
-        enum ParseResult
+        // Hash and displace perfect hash: the route hash picks a bucket,
+        // the bucket's displacement picks a distinct slot for every route
+        // in it.
+        template<std::size_t RouteCount, std::size_t SlotCount>
+        struct StaticRouteTable
         {
-            ParsingCompleted,
-            ParsingIncompleted,
-            ParsingError
+            bool found = false;
+            uint64_t seed = 0;
+            std::array<uint16_t, RouteCount> displacements{};
+            std::array<int16_t, SlotCount> slots{};
         };
 
-        inline ParseResult ParseRequest(const std::string& requestData, Request& req)
+        template<std::size_t RouteCount, std::size_t SlotCount>
+        constexpr StaticRouteTable<RouteCount, SlotCount> MakeStaticRouteTable(
+            const std::array<std::string_view, RouteCount>& methods, const std::array<std::string_view, RouteCount>& paths)
         {
-            // Parser from https://github.com/nekipelov/httpparser
-            std::vector<std::pair<std::string, std::string>> headers;
-            std::vector<std::pair<std::string, std::string>> params;
-            State state = RequestMethodStart;
-            bool chunked = false;
-            size_t contentSize = 0;
-            
-            for (char input : requestData)
+            StaticRouteTable<RouteCount, SlotCount> table;
+            for (uint64_t seed = 0; seed < 64; seed++)
             {
-                switch (state)
+                std::array<uint64_t, RouteCount> hashes{};
+                std::array<std::size_t, RouteCount> bucketSizes{};
+                for (std::size_t i = 0; i < RouteCount; i++)
                 {
-                case RequestMethodStart:
-                    if( !IsChar(input) || IsControl(input) || IsSpecial(input) )
-                    {
-                        return ParsingError;
-                    }
-                    else
-                    {
-                        state = RequestMethod;
-                        req.method.push_back(input);
-                    }
-                    break;
-                case RequestMethod:
-                    if( input == ' ' )
-                    {
-                        state = RequestUriStart;
-                    }
-                    else if( !IsChar(input) || IsControl(input) || IsSpecial(input) )
-                    {
-                        return ParsingError;
-                    }
-                    else
-                    {
-                        req.method.push_back(input);
-                    }
-                    break;
-                case RequestUriStart:
-                    if( IsControl(input) )
-                    {
-                        return ParsingError;
-                    }
-                    else
-                    {
-                        state = RequestUri;
-                        req.path.push_back(input);
-                    }
-                    break;
-                case RequestUri:
-                    if( input == ' ' )
-                    {
-                        state = RequestHttpVersion_h;
-                    }
-                    else if (input == '\r')
-                    {
-                        req.versionMajor = 0;
-                        req.versionMinor = 9;
+                    hashes[i] = RouteHash(seed, methods[i], paths[i]);
+                    bucketSizes[hashes[i] % RouteCount]++;
+                }
+                for (auto& slot : table.slots)
+                    slot = -1;
 
-                        return ParsingCompleted;
-                    }
-                    else if( IsControl(input) )
-                    {
-                        return ParsingError;
-                    }
-                    else
-                    {
-                        req.path.push_back(input);
-                    }
-                    break;
-                case RequestHttpVersion_h:
-                    if( input == 'H' )
-                    {
-                        state = RequestHttpVersion_ht;
-                    }
-                    else
-                    {
-                        return ParsingError;
-                    }
-                    break;
-                case RequestHttpVersion_ht:
-                    if( input == 'T' )
+                // Largest buckets first, while most slots are free
+                bool placed = true;
+                for (std::size_t size = RouteCount; size > 0 && placed; size--)
+                    for (std::size_t bucket = 0; bucket < RouteCount && placed; bucket++)
                     {
-                        state = RequestHttpVersion_htt;
+                        if (bucketSizes[bucket] != size)
+                            continue;
+
+                        placed = false;
+                        for (uint32_t displacement = 0; displacement < 65536 && !placed; displacement++)
+                        {
+                            placed = true;
+                            std::size_t taken = 0;
+                            for (std::size_t i = 0; i < RouteCount && placed; i++)
+                            {
+                                if (hashes[i] % RouteCount != bucket)
+                                    continue;
+                                auto& slot = table.slots[RouteSlot(hashes[i], displacement, SlotCount - 1)];
+                                if (slot != -1)
+                                {
+                                    placed = false;
+                                    break;
+                                }
+                                slot = static_cast<int16_t>(i);
+                                taken++;
+                            }
+                            if (!placed)
+                            {
+                                // Undo the routes of this bucket placed with this displacement
+                                for (std::size_t i = 0; i < RouteCount && taken > 0; i++)
+                                {
+                                    if (hashes[i] % RouteCount != bucket)
+                                        continue;
+                                    auto& slot = table.slots[RouteSlot(hashes[i], displacement, SlotCount - 1)];
+                                    if (slot == static_cast<int16_t>(i))
+                                    {
+                                        slot = -1;
+                                        taken--;
+                                    }
+                                }
+                            }
+                            else
+                                table.displacements[bucket] = static_cast<uint16_t>(displacement);
+                        }
                     }
-                    else
+
+                if (placed)
+                {
+                    table.found = true;
+                    table.seed = seed;
+                    return table;
+                }
+            }
+            return table;
+        }
+
+        template<std::size_t RouteCount>
+        constexpr bool StaticRoutesDistinct(const std::array<std::string_view, RouteCount>& methods,
+            const std::array<std::string_view, RouteCount>& paths)
+        {
+            for (std::size_t i = 0; i < RouteCount; i++)
+                for (std::size_t j = i + 1; j < RouteCount; j++)
+                    if (methods[i] == methods[j] && paths[i] == paths[j])
+                        return false;
+            return true;
+        }
+
+        constexpr std::size_t StaticRouteSlots(std::size_t routes)
+        {
+            std::size_t slots = 2;
+            while (slots < routes * 2)
+                slots *= 2;
+            return slots;
+        }
+
+        // A StaticRouter mounted on a server, type erased once per router.
+        struct MountedRouter
+        {
+            int (*find)(std::string_view method, std::string_view path);
+            void (*invoke)(int route, const Request& req, Response& res);
+            std::vector<std::pair<std::string_view, std::string_view>> routes; // method, path
+            std::size_t firstId = 0;
+        };
+
+        // Methods routed for one path and its pre-rendered OPTIONS
+        // responses: status line and headers, without the Date header and
+        // the final empty line.
+        struct PathRoutes
+        {
+            std::string allow;
+            std::string options;
+            std::string preflight; // CORS preflight, empty when CORS is off
+        };
+    }
+
+    // Routes known at compile time. Every Route type declares
+    //     static constexpr std::string_view path = "/health";
+    //     static constexpr std::string_view method = "GET"; // optional, GET by default
+    //     static void Handle(const Request& req, Response& res);
+    // The router matches with a perfect hash built at compile time and
+    // calls Handle directly, so handlers are inlined into the dispatch.
+    // Duplicate routes fail to compile.
+    template<typename... Routes>
+    class StaticRouter
+    {
+    public:
+        static constexpr std::size_t RouteCount = sizeof...(Routes);
+        static_assert(RouteCount > 0 && RouteCount < 16384, "StaticRouter needs between 1 and 16383 routes");
+
+        static constexpr std::array<std::string_view, RouteCount> Methods = { Details::RouteMethodOf<Routes>::value... };
+        static constexpr std::array<std::string_view, RouteCount> Paths = { Routes::path... };
+
+        // Index of the route matching method and path, -1 if none.
+        static int Find(std::string_view method, std::string_view path)
+        {
+            uint64_t hash = Details::RouteHash(Table.seed, method, path);
+            int route = Table.slots[Details::RouteSlot(hash, Table.displacements[hash % RouteCount], SlotCount - 1)];
+            if (route < 0 || Paths[route] != path || Methods[route] != method)
+                return -1;
+            return route;
+        }
+
+        static void Invoke(int route, const Request& req, Response& res)
+        {
+            Invoke(route, req, res, std::index_sequence_for<Routes...>());
+        }
+
+    private:
+        template<std::size_t... Index>
+        static void Invoke(int route, const Request& req, Response& res, std::index_sequence<Index...>)
+        {
+            ((route == static_cast<int>(Index) ? (Routes::Handle(req, res), true) : false) || ...);
+        }
+
+    private:
+        static constexpr std::size_t SlotCount = Details::StaticRouteSlots(RouteCount);
+        static constexpr bool Distinct = Details::StaticRoutesDistinct<RouteCount>(Methods, Paths);
+        static_assert(Distinct, "StaticRouter routes must have distinct method and path");
+        // Duplicates have no perfect hash, the search is skipped
+        static constexpr Details::StaticRouteTable<RouteCount, SlotCount> Table = Distinct ?
+            Details::MakeStaticRouteTable<RouteCount, SlotCount>(Methods, Paths) : Details::StaticRouteTable<RouteCount, SlotCount>();
+        static_assert(!Distinct || Table.found, "StaticRouter found no perfect hash for these routes in 64 seeds");
+    };
+
+    namespace Details
+    {
+        // Bounded work-stealing thread pool. Every worker owns a deque, pops
+        // from its front and steals from the back of the other workers when
+        // it runs dry. TrySubmit fails instead of blocking once maxQueueDepth
+        // tasks are waiting.
+        class WorkStealingPool
+        {
+        public:
+            typedef Function<void()> Task;
+
+            WorkStealingPool(std::size_t threads, std::size_t maxQueueDepth) :
+                m_MaxQueueDepth(maxQueueDepth)
+            {
+                if (threads == 0)
+                    threads = 1;
+                for (std::size_t i = 0; i < threads; i++)
+                    m_Queues.emplace_back(std::make_unique<Queue>());
+                for (std::size_t i = 0; i < threads; i++)
+                    m_Threads.emplace_back([this, i] () { WorkerLoop(i); });
+            }
+
+            ~WorkStealingPool()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m_SleepMutex);
+                    m_Stop = true;
+                }
+                m_SleepCv.notify_all();
+                for (auto& thread : m_Threads)
+                    thread.join();
+            }
+
+            bool TrySubmit(Task task)
+            {
+                if (m_Queued.fetch_add(1, std::memory_order_acq_rel) >= m_MaxQueueDepth)
+                {
+                    m_Queued.fetch_sub(1, std::memory_order_acq_rel);
+                    return false;
+                }
+
+                // Tasks submitted from a worker stay on its own deque
+                std::size_t index = CurrentWorker().pool == this ?
+                    CurrentWorker().index :
+                    m_NextQueue.fetch_add(1, std::memory_order_relaxed) % m_Queues.size();
+                {
+                    std::lock_guard<std::mutex> lock(m_Queues[index]->mutex);
+                    m_Queues[index]->tasks.push_back(std::move(task));
+                }
+                {
+                    std::lock_guard<std::mutex> lock(m_SleepMutex);
+                }
+                m_SleepCv.notify_one();
+                return true;
+            }
+
+            std::size_t QueueDepth() const
+            {
+                return m_Queued.load(std::memory_order_relaxed);
+            }
+
+        private:
+            struct Queue
+            {
+                std::mutex mutex;
+                std::deque<Task> tasks;
+            };
+
+            struct WorkerInfo
+            {
+                WorkStealingPool* pool = nullptr;
+                std::size_t index = 0;
+            };
+
+            static WorkerInfo& CurrentWorker()
+            {
+                static thread_local WorkerInfo info;
+                return info;
+            }
+
+            bool TryPop(std::size_t index, Task& task)
+            {
+                {
+                    auto& own = *m_Queues[index];
+                    std::lock_guard<std::mutex> lock(own.mutex);
+                    if (!own.tasks.empty())
                     {
-                        return ParsingError;
+                        task = std::move(own.tasks.front());
+                        own.tasks.pop_front();
+                        return true;
                     }
-                    break;
-                case RequestHttpVersion_htt:
-                    if( input == 'T' )
+                }
+                for (std::size_t i = 1; i < m_Queues.size(); i++)
+                {
+                    auto& victim = *m_Queues[(index + i) % m_Queues.size()];
+                    std::lock_guard<std::mutex> lock(victim.mutex);
+                    if (!victim.tasks.empty())
                     {
-                        state = RequestHttpVersion_http;
+                        task = std::move(victim.tasks.back());
+                        victim.tasks.pop_back();
+                        return true;
                     }
-                    else
+                }
+                return false;
+            }
+
+            void WorkerLoop(std::size_t index)
+            {
+                CurrentWorker().pool = this;
+                CurrentWorker().index = index;
+
+                for (;;)
+                {
+                    Task task;
+                    if (TryPop(index, task))
                     {
-                        return ParsingError;
+                        m_Queued.fetch_sub(1, std::memory_order_acq_rel);
+                        task();
+                        continue;
                     }
-                    break;
-                case RequestHttpVersion_http:
-                    if( input == 'P' )
+
+                    std::unique_lock<std::mutex> lock(m_SleepMutex);
+                    if (m_Stop && m_Queued.load(std::memory_order_acquire) == 0)
+                        return;
+                    m_SleepCv.wait(lock, [this] () {
+                        return m_Stop || m_Queued.load(std::memory_order_acquire) > 0;
+                    });
+                }
+            }
+
+        private:
+            std::vector<std::unique_ptr<Queue>> m_Queues;
+            std::vector<std::thread> m_Threads;
+            std::atomic<std::size_t> m_Queued{0};
+            std::atomic<std::size_t> m_NextQueue{0};
+            std::size_t m_MaxQueueDepth;
+            std::mutex m_SleepMutex;
+            std::condition_variable m_SleepCv;
+            bool m_Stop = false;
+        };
+
+        // Request counters, gauges and latency histograms. Every thread
+        // writes to its own shard with relaxed atomic adds; shards are
+        // only summed when the metrics are scraped.
+        class Metrics
+        {
+        public:
+            static constexpr std::size_t ShardCount = 16;
+            static constexpr std::size_t StatusCount = 600;
+            // Upper bounds of the latency buckets in nanoseconds
+            static constexpr std::array<uint64_t, 14> LatencyBuckets = {
+                500000, 1000000, 2500000, 5000000, 10000000, 25000000, 50000000,
+                100000000, 250000000, 500000000, 1000000000, 2500000000, 5000000000, 10000000000
+            };
+
+            struct RouteLabel
+            {
+                std::string method;
+                std::string path;
+            };
+
+            // Must be called before the first sample is recorded. The last
+            // route slot collects requests that matched no route.
+            void Init(std::vector<RouteLabel> routes)
+            {
+                m_Routes = std::move(routes);
+                m_Routes.push_back({"ANY", "<unmatched>"});
+                for (auto& shard : m_Shards)
+                {
+                    // Padded on both sides so neighbouring shards never share a cache line
+                    shard.reset(new std::atomic<uint64_t>[SlotCount() + 16]());
+                }
+            }
+
+            std::size_t UnmatchedRoute() const { return m_Routes.size() - 1; }
+
+            void ConnectionOpened()
+            {
+                Slot(ActiveConnectionsSlot).fetch_add(1, std::memory_order_relaxed);
+                Slot(AcceptedConnectionsSlot).fetch_add(1, std::memory_order_relaxed);
+            }
+
+            void ConnectionClosed()
+            {
+                Slot(ActiveConnectionsSlot).fetch_sub(1, std::memory_order_relaxed);
+            }
+
+            void RequestStarted()
+            {
+                Slot(InFlightSlot).fetch_add(1, std::memory_order_relaxed);
+            }
+
+            void RequestFinished(std::size_t route, uint16_t status, std::chrono::nanoseconds duration)
+            {
+                uint64_t ns = static_cast<uint64_t>(duration.count());
+                std::size_t bucket = 0;
+                while (bucket < LatencyBuckets.size() && ns > LatencyBuckets[bucket])
+                    bucket++;
+
+                auto* shard = CurrentShard();
+                shard[InFlightSlot].fetch_sub(1, std::memory_order_relaxed);
+                shard[StatusSlot(status < StatusCount ? status : 0)].fetch_add(1, std::memory_order_relaxed);
+                shard[RouteSlot(route) + RouteCount].fetch_add(1, std::memory_order_relaxed);
+                shard[RouteSlot(route) + RouteSum].fetch_add(ns, std::memory_order_relaxed);
+                shard[RouteSlot(route) + RouteBuckets + bucket].fetch_add(1, std::memory_order_relaxed);
+            }
+
+            // Renders every metric in the Prometheus text exposition format.
+            std::string Render() const
+            {
+                std::vector<uint64_t> totals(SlotCount(), 0);
+                for (auto& shard : m_Shards)
+                    if (shard)
+                        for (std::size_t i = 0; i < totals.size(); i++)
+                            totals[i] += shard[i + 8].load(std::memory_order_relaxed);
+
+                std::string out;
+                out.reserve(256 + m_Routes.size() * 1024);
+
+                out += "# HELP simple_http_connections_active Connections currently open.\n";
+                out += "# TYPE simple_http_connections_active gauge\n";
+                out += "simple_http_connections_active " + std::to_string(static_cast<int64_t>(totals[ActiveConnectionsSlot])) + "\n";
+                out += "# HELP simple_http_connections_accepted_total Connections accepted.\n";
+                out += "# TYPE simple_http_connections_accepted_total counter\n";
+                out += "simple_http_connections_accepted_total " + std::to_string(totals[AcceptedConnectionsSlot]) + "\n";
+                out += "# HELP simple_http_requests_in_flight Requests being handled or written.\n";
+                out += "# TYPE simple_http_requests_in_flight gauge\n";
+                out += "simple_http_requests_in_flight " + std::to_string(static_cast<int64_t>(totals[InFlightSlot])) + "\n";
+
+                out += "# HELP simple_http_responses_total Responses sent by status code.\n";
+                out += "# TYPE simple_http_responses_total counter\n";
+                for (std::size_t status = 100; status < StatusCount; status++)
+                    if (totals[StatusSlot(status)])
+                        out += "simple_http_responses_total{code=\"" + std::to_string(status) + "\"} " + std::to_string(totals[StatusSlot(status)]) + "\n";
+
+                out += "# HELP simple_http_requests_total Requests answered by route.\n";
+                out += "# TYPE simple_http_requests_total counter\n";
+                for (std::size_t route = 0; route < m_Routes.size(); route++)
+                    out += "simple_http_requests_total{" + Labels(route) + "} " + std::to_string(totals[RouteSlot(route) + RouteCount]) + "\n";
+
+                out += "# HELP simple_http_request_duration_seconds Time from dispatch to response written.\n";
+                out += "# TYPE simple_http_request_duration_seconds histogram\n";
+                for (std::size_t route = 0; route < m_Routes.size(); route++)
+                {
+                    const std::string labels = Labels(route);
+                    uint64_t cumulative = 0;
+                    for (std::size_t bucket = 0; bucket <= LatencyBuckets.size(); bucket++)
                     {
-                        state = RequestHttpVersion_slash;
+                        cumulative += totals[RouteSlot(route) + RouteBuckets + bucket];
+                        std::ostringstream le;
+                        if (bucket < LatencyBuckets.size())
+                            le << LatencyBuckets[bucket] / 1e9;
+                        else
+                            le << "+Inf";
+                        out += "simple_http_request_duration_seconds_bucket{" + labels + ",le=\"" + le.str() + "\"} " + std::to_string(cumulative) + "\n";
+                    }
+                    std::ostringstream sum;
+                    sum << std::setprecision(9) << totals[RouteSlot(route) + RouteSum] / 1e9;
+                    out += "simple_http_request_duration_seconds_sum{" + labels + "} " + sum.str() + "\n";
+                    out += "simple_http_request_duration_seconds_count{" + labels + "} " + std::to_string(cumulative) + "\n";
+                }
+
+                return out;
+            }
+
+        private:
+            // Slot layout of a shard: gauges, one counter per status code,
+            // then count, duration sum and buckets for every route.
+            enum : std::size_t
+            {
+                ActiveConnectionsSlot,
+                AcceptedConnectionsSlot,
+                InFlightSlot,
+                FirstStatusSlot
+            };
+
+            enum : std::size_t
+            {
+                RouteCount,
+                RouteSum,
+                RouteBuckets,
+                RouteStride = RouteBuckets + LatencyBuckets.size() + 1
+            };
+
+            static std::size_t StatusSlot(std::size_t status) { return FirstStatusSlot + status; }
+            static std::size_t RouteSlot(std::size_t route) { return FirstStatusSlot + StatusCount + route * RouteStride; }
+            std::size_t SlotCount() const { return RouteSlot(m_Routes.size()); }
+
+            std::atomic<uint64_t>* CurrentShard()
+            {
+                static std::atomic<std::size_t> nextShard{0};
+                static thread_local std::size_t shard = nextShard.fetch_add(1, std::memory_order_relaxed) % ShardCount;
+                return m_Shards[shard].get() + 8;
+            }
+
+            std::atomic<uint64_t>& Slot(std::size_t slot)
+            {
+                return CurrentShard()[slot];
+            }
+
+            static void AppendEscaped(std::string& out, const std::string& value)
+            {
+                for (char c : value)
+                {
+                    if (c == '\\' || c == '"')
+                        out.push_back('\\');
+                    if (c == '\n')
+                        out += "\\n";
+                    else
+                        out.push_back(c);
+                }
+            }
+
+            std::string Labels(std::size_t route) const
+            {
+                std::string labels = "method=\"";
+                AppendEscaped(labels, m_Routes[route].method);
+                labels += "\",route=\"";
+                AppendEscaped(labels, m_Routes[route].path);
+                labels += "\"";
+                return labels;
+            }
+
+        private:
+            std::vector<RouteLabel> m_Routes;
+            std::array<std::unique_ptr<std::atomic<uint64_t>[]>, ShardCount> m_Shards;
+        };
+
+        // HDR-style log-linear histogram. Values below 2^SubBucketBits get
+        // an exact bucket, every following power-of-two range is split into
+        // 2^SubBucketBits linear sub-buckets, bounding the relative error to
+        // about 3%. Record is meant for a single writer thread; readers may
+        // load the counts concurrently.
+        class LogLinearHistogram
+        {
+        public:
+            static constexpr unsigned SubBucketBits = 5;
+            static constexpr unsigned MaxValueBits = 40; // ~18 minutes in ns
+            static constexpr uint64_t SubBucketCount = uint64_t(1) << SubBucketBits;
+            static constexpr uint64_t MaxValue = (uint64_t(1) << MaxValueBits) - 1;
+            static constexpr std::size_t BucketCount = SubBucketCount * (MaxValueBits - SubBucketBits + 1);
+
+            LogLinearHistogram()
+            {
+                for (auto& count : m_Counts)
+                    count.store(0, std::memory_order_relaxed);
+            }
+
+            static std::size_t IndexOf(uint64_t value)
+            {
+                if (value > MaxValue)
+                    value = MaxValue;
+                if (value < SubBucketCount)
+                    return static_cast<std::size_t>(value);
+                unsigned msb = 63 - Clz(value);
+                unsigned shift = msb - SubBucketBits;
+                return static_cast<std::size_t>(SubBucketCount * (shift + 1) + ((value >> shift) - SubBucketCount));
+            }
+
+            // Largest value that maps to the bucket.
+            static uint64_t HighestValueAt(std::size_t index)
+            {
+                if (index < SubBucketCount)
+                    return index;
+                uint64_t shift = index / SubBucketCount - 1;
+                uint64_t sub = index % SubBucketCount;
+                return ((SubBucketCount + sub + 1) << shift) - 1;
+            }
+
+            void Record(uint64_t value)
+            {
+                Bump(m_Counts[IndexOf(value)], 1);
+                Bump(m_Total, 1);
+                Bump(m_Sum, value);
+                if (value > m_Max.load(std::memory_order_relaxed))
+                    m_Max.store(value, std::memory_order_relaxed);
+            }
+
+            // Adds the counts of another histogram into this one. Not safe
+            // against concurrent writers of this histogram.
+            void Merge(const LogLinearHistogram& other)
+            {
+                for (std::size_t i = 0; i < BucketCount; i++)
+                    Bump(m_Counts[i], other.m_Counts[i].load(std::memory_order_relaxed));
+                Bump(m_Total, other.m_Total.load(std::memory_order_relaxed));
+                Bump(m_Sum, other.m_Sum.load(std::memory_order_relaxed));
+                if (other.Max() > Max())
+                    m_Max.store(other.Max(), std::memory_order_relaxed);
+            }
+
+            uint64_t Count() const { return m_Total.load(std::memory_order_relaxed); }
+            uint64_t Max() const { return m_Max.load(std::memory_order_relaxed); }
+            double Mean() const
+            {
+                uint64_t count = Count();
+                return count ? static_cast<double>(m_Sum.load(std::memory_order_relaxed)) / count : 0.0;
+            }
+
+            uint64_t ValueAtPercentile(double percentile) const
+            {
+                uint64_t total = 0;
+                for (auto& count : m_Counts)
+                    total += count.load(std::memory_order_relaxed);
+                if (total == 0)
+                    return 0;
+
+                uint64_t rank = static_cast<uint64_t>(percentile / 100.0 * total + 0.5);
+                if (rank == 0)
+                    rank = 1;
+                uint64_t seen = 0;
+                for (std::size_t i = 0; i < BucketCount; i++)
+                {
+                    seen += m_Counts[i].load(std::memory_order_relaxed);
+                    if (seen >= rank)
+                        return std::min(HighestValueAt(i), Max());
+                }
+                return Max();
+            }
+
+        private:
+            static unsigned Clz(uint64_t value)
+            {
+#if defined(_MSC_VER)
+                unsigned long index;
+                _BitScanReverse64(&index, value);
+                return 63 - index;
+#else
+                return __builtin_clzll(value);
+#endif
+            }
+
+            static void Bump(std::atomic<uint64_t>& counter, uint64_t value)
+            {
+                counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+            }
+
+        private:
+            std::array<std::atomic<uint64_t>, BucketCount> m_Counts;
+            std::atomic<uint64_t> m_Total{0};
+            std::atomic<uint64_t> m_Sum{0};
+            std::atomic<uint64_t> m_Max{0};
+        };
+
+        enum Phase
+        {
+            PhaseAccept,
+            PhaseFirstByte,
+            PhaseHeadersParsed,
+            PhaseHandlerStart,
+            PhaseHandlerEnd,
+            PhaseWriteComplete,
+            PhaseCount
+        };
+
+        typedef std::array<std::chrono::steady_clock::time_point, PhaseCount> PhaseTimestamps;
+
+        // Per-thread histograms of the time spent between consecutive
+        // request phases. Every thread records into its own set, sets are
+        // only merged when queried.
+        class PhaseHistograms
+        {
+        public:
+            static constexpr std::size_t IntervalCount = PhaseCount; // One per phase transition plus the total
+
+            static const char* IntervalName(std::size_t interval)
+            {
+                static const char* names[IntervalCount] = {
+                    "accept_to_first_byte",
+                    "first_byte_to_headers",
+                    "headers_to_handler",
+                    "handler",
+                    "write",
+                    "first_byte_to_write_complete"
+                };
+                return names[interval];
+            }
+
+            PhaseHistograms() :
+                m_Id(NextId().fetch_add(1, std::memory_order_relaxed))
+            {
+            }
+
+            void Record(const PhaseTimestamps& stamps)
+            {
+                auto& local = Local();
+                for (std::size_t phase = 1; phase < PhaseCount; phase++)
+                    local.histograms[phase - 1].Record(Nanoseconds(stamps[phase - 1], stamps[phase]));
+                local.histograms[IntervalCount - 1].Record(Nanoseconds(stamps[PhaseFirstByte], stamps[PhaseWriteComplete]));
+            }
+
+            std::vector<PhaseSummary> Summarize() const
+            {
+                std::vector<PhaseSummary> summaries;
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                for (std::size_t interval = 0; interval < IntervalCount; interval++)
+                {
+                    auto merged = std::make_unique<LogLinearHistogram>();
+                    for (auto& thread : m_Threads)
+                        merged->Merge(thread->histograms[interval]);
+
+                    PhaseSummary summary;
+                    summary.name = IntervalName(interval);
+                    summary.count = merged->Count();
+                    summary.mean = merged->Mean();
+                    summary.p50 = merged->ValueAtPercentile(50.0);
+                    summary.p90 = merged->ValueAtPercentile(90.0);
+                    summary.p99 = merged->ValueAtPercentile(99.0);
+                    summary.p999 = merged->ValueAtPercentile(99.9);
+                    summary.max = merged->Max();
+                    summaries.push_back(std::move(summary));
+                }
+                return summaries;
+            }
+
+            std::string Report() const
+            {
+                std::ostringstream out;
+                out << std::left << std::setw(30) << "phase (us)" << std::right
+                    << std::setw(12) << "count" << std::setw(12) << "mean" << std::setw(12) << "p50"
+                    << std::setw(12) << "p90" << std::setw(12) << "p99" << std::setw(12) << "p99.9"
+                    << std::setw(12) << "max" << "\n";
+                out << std::fixed << std::setprecision(1);
+                for (auto& summary : Summarize())
+                {
+                    out << std::left << std::setw(30) << summary.name << std::right
+                        << std::setw(12) << summary.count << std::setw(12) << summary.mean / 1e3
+                        << std::setw(12) << summary.p50 / 1e3 << std::setw(12) << summary.p90 / 1e3
+                        << std::setw(12) << summary.p99 / 1e3 << std::setw(12) << summary.p999 / 1e3
+                        << std::setw(12) << summary.max / 1e3 << "\n";
+                }
+                return out.str();
+            }
+
+        private:
+            struct ThreadHistograms
+            {
+                std::array<LogLinearHistogram, IntervalCount> histograms;
+            };
+
+            static std::atomic<uint64_t>& NextId()
+            {
+                static std::atomic<uint64_t> id{0};
+                return id;
+            }
+
+            static uint64_t Nanoseconds(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to)
+            {
+                auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count();
+                return ns > 0 ? static_cast<uint64_t>(ns) : 0;
+            }
+
+            ThreadHistograms& Local()
+            {
+                // Keyed by id rather than address so a new instance never
+                // picks up the cached set of a destroyed one
+                static thread_local std::vector<std::pair<uint64_t, ThreadHistograms*>> cache;
+                for (auto& [id, histograms] : cache)
+                    if (id == m_Id)
+                        return *histograms;
+
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                m_Threads.push_back(std::make_unique<ThreadHistograms>());
+                cache.emplace_back(m_Id, m_Threads.back().get());
+                return *m_Threads.back();
+            }
+
+        private:
+            const uint64_t m_Id;
+            mutable std::mutex m_Mutex;
+            std::vector<std::unique_ptr<ThreadHistograms>> m_Threads;
+        };
+
+        // Fixed-size access log entry. Strings are truncated to fit.
+        struct AccessLogRecord
+        {
+            int64_t time;           // Unix time in nanoseconds
+            uint64_t durationNs;
+            uint64_t bytesSent;
+            uint16_t status;
+            uint8_t versionMajor;
+            uint8_t versionMinor;
+            uint8_t addressFamily;  // 4, 6 or 0 when unknown
+            uint8_t address[16];
+            char method[12];
+            char path[256];
+            char referer[128];
+            char userAgent[128];
+        };
+
+        // Single producer, single consumer ring of access log records.
+        class AccessLogRing
+        {
+        public:
+            explicit AccessLogRing(std::size_t capacity) :
+                m_Mask(capacity - 1), m_Records(new AccessLogRecord[capacity])
+            {
+            }
+
+            // Producer side, never blocks. Returns a slot to fill or nullptr
+            // when the ring is full; the slot is published by Commit.
+            AccessLogRecord* Reserve()
+            {
+                uint64_t head = m_Head.load(std::memory_order_relaxed);
+                if (head - m_CachedTail > m_Mask)
+                {
+                    m_CachedTail = m_Tail.load(std::memory_order_acquire);
+                    if (head - m_CachedTail > m_Mask)
+                    {
+                        m_Dropped.fetch_add(1, std::memory_order_relaxed);
+                        return nullptr;
+                    }
+                }
+                return &m_Records[head & m_Mask];
+            }
+
+            void Commit()
+            {
+                m_Head.store(m_Head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+            }
+
+            // Consumer side.
+            template<typename Function>
+            std::size_t Drain(Function&& consume)
+            {
+                uint64_t tail = m_Tail.load(std::memory_order_relaxed);
+                uint64_t head = m_Head.load(std::memory_order_acquire);
+                for (uint64_t i = tail; i != head; i++)
+                    consume(m_Records[i & m_Mask]);
+                m_Tail.store(head, std::memory_order_release);
+                return static_cast<std::size_t>(head - tail);
+            }
+
+            uint64_t Dropped() const { return m_Dropped.load(std::memory_order_relaxed); }
+
+        private:
+            const uint64_t m_Mask;
+            std::unique_ptr<AccessLogRecord[]> m_Records;
+            alignas(64) std::atomic<uint64_t> m_Head{0};
+            uint64_t m_CachedTail = 0;
+            std::atomic<uint64_t> m_Dropped{0};
+            alignas(64) std::atomic<uint64_t> m_Tail{0};
+        };
+
+        // Access log written by a background thread. Network threads only
+        // copy a record into their own ring; the writer drains all rings,
+        // formats the records and writes them in batches.
+        class AccessLog
+        {
+        public:
+            explicit AccessLog(const AccessLogOptions& options) :
+                m_Options(options), m_Id(NextId().fetch_add(1, std::memory_order_relaxed))
+            {
+                std::size_t capacity = 1;
+                while (capacity < m_Options.ringCapacity)
+                    capacity <<= 1;
+                m_Options.ringCapacity = capacity;
+
+                Open();
+                m_Thread = std::thread([this] () { WriterLoop(); });
+            }
+
+            ~AccessLog()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m_Mutex);
+                    m_Stop = true;
+                }
+                m_WakeCv.notify_one();
+                m_Thread.join();
+                Close();
+            }
+
+            AccessLogRecord* Reserve() { return Local().Reserve(); }
+            void Commit() { Local().Commit(); }
+
+            // Asks the writer to reopen the file, e.g. after logrotate moved it.
+            void Reopen()
+            {
+                m_ReopenRequested.store(true, std::memory_order_relaxed);
+            }
+
+            uint64_t Dropped() const
+            {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                uint64_t dropped = 0;
+                for (auto& ring : m_Rings)
+                    dropped += ring->Dropped();
+                return dropped;
+            }
+
+            const AccessLogOptions& Options() const { return m_Options; }
+
+        private:
+            static std::atomic<uint64_t>& NextId()
+            {
+                static std::atomic<uint64_t> id{0};
+                return id;
+            }
+
+            AccessLogRing& Local()
+            {
+                static thread_local std::vector<std::pair<uint64_t, AccessLogRing*>> cache;
+                for (auto& [id, ring] : cache)
+                    if (id == m_Id)
+                        return *ring;
+
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                m_Rings.push_back(std::make_unique<AccessLogRing>(m_Options.ringCapacity));
+                cache.emplace_back(m_Id, m_Rings.back().get());
+                return *m_Rings.back();
+            }
+
+            void Open()
+            {
+                if (m_Options.path == "-")
+                {
+                    m_File = stdout;
+                    return;
+                }
+                m_File = std::fopen(m_Options.path.c_str(), "a");
+                if (!m_File)
+                    throw std::runtime_error("Cannot open access log " + m_Options.path);
+                std::setvbuf(m_File, nullptr, _IOFBF, 64 * 1024);
+            }
+
+            void Close()
+            {
+                if (m_File && m_File != stdout)
+                    std::fclose(m_File);
+                else if (m_File)
+                    std::fflush(m_File);
+                m_File = nullptr;
+            }
+
+            void WriterLoop()
+            {
+                std::string batch;
+                batch.reserve(256 * 1024);
+                std::vector<AccessLogRing*> rings;
+
+                for (;;)
+                {
+                    bool stop;
+                    {
+                        std::unique_lock<std::mutex> lock(m_Mutex);
+                        m_WakeCv.wait_for(lock, std::chrono::milliseconds(20), [this] () { return m_Stop; });
+                        stop = m_Stop;
+                        rings.clear();
+                        for (auto& ring : m_Rings)
+                            rings.push_back(ring.get());
+                    }
+
+                    if (m_ReopenRequested.exchange(false, std::memory_order_relaxed) && m_File != stdout)
+                    {
+                        Close();
+                        try { Open(); } catch (const std::exception&) {}
+                    }
+
+                    for (auto* ring : rings)
+                    {
+                        ring->Drain([this, &batch] (const AccessLogRecord& record) {
+                            Format(record, batch);
+                            if (batch.size() >= 192 * 1024)
+                                Flush(batch);
+                        });
+                    }
+                    Flush(batch);
+                    if (m_File)
+                        std::fflush(m_File);
+
+                    if (stop)
+                        return;
+                }
+            }
+
+            void Flush(std::string& batch)
+            {
+                if (m_File && !batch.empty())
+                    std::fwrite(batch.data(), 1, batch.size(), m_File);
+                batch.clear();
+            }
+
+            static void AppendEscaped(std::string& out, const char* value, bool json)
+            {
+                static const char* hex = "0123456789abcdef";
+                for (; *value; value++)
+                {
+                    unsigned char c = static_cast<unsigned char>(*value);
+                    if (c == '"' || c == '\\')
+                    {
+                        out.push_back('\\');
+                        out.push_back(c);
+                    }
+                    else if (c < 0x20 || c == 0x7f)
+                    {
+                        out += json ? "\\u00" : "\\x";
+                        out.push_back(hex[c >> 4]);
+                        out.push_back(hex[c & 0xf]);
+                    }
+                    else
+                        out.push_back(c);
+                }
+            }
+
+            static std::string AddressString(const AccessLogRecord& record)
+            {
+                if (record.addressFamily == 4)
+                {
+                    asio::ip::address_v4::bytes_type bytes;
+                    std::memcpy(bytes.data(), record.address, bytes.size());
+                    return asio::ip::address_v4(bytes).to_string();
+                }
+                if (record.addressFamily == 6)
+                {
+                    asio::ip::address_v6::bytes_type bytes;
+                    std::memcpy(bytes.data(), record.address, bytes.size());
+                    return asio::ip::address_v6(bytes).to_string();
+                }
+                return "-";
+            }
+
+            void Format(const AccessLogRecord& record, std::string& out)
+            {
+                std::time_t seconds = static_cast<std::time_t>(record.time / 1000000000);
+                if (seconds != m_CachedSecond)
+                {
+                    std::tm tm;
+#if defined(_WIN32)
+                    gmtime_s(&tm, &seconds);
+#else
+                    gmtime_r(&seconds, &tm);
+#endif
+                    char buffer[64];
+                    m_CachedClf.assign(buffer, std::strftime(buffer, sizeof(buffer), "[%d/%b/%Y:%H:%M:%S +0000]", &tm));
+                    m_CachedIso.assign(buffer, std::strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S", &tm));
+                    m_CachedSecond = seconds;
+                }
+
+                const std::string version = "HTTP/" + std::to_string(record.versionMajor) + "." + std::to_string(record.versionMinor);
+                if (m_Options.format == AccessLogFormat::Json)
+                {
+                    char fraction[16];
+                    std::snprintf(fraction, sizeof(fraction), ".%06dZ", static_cast<int>(record.time % 1000000000 / 1000));
+                    out += "{\"time\":\"" + m_CachedIso + fraction;
+                    out += "\",\"remote_addr\":\"" + AddressString(record);
+                    out += "\",\"method\":\"";
+                    AppendEscaped(out, record.method, true);
+                    out += "\",\"path\":\"";
+                    AppendEscaped(out, record.path, true);
+                    out += "\",\"protocol\":\"" + version;
+                    out += "\",\"status\":" + std::to_string(record.status);
+                    out += ",\"bytes\":" + std::to_string(record.bytesSent);
+                    out += ",\"duration_us\":" + std::to_string(record.durationNs / 1000);
+                    out += ",\"referer\":\"";
+                    AppendEscaped(out, record.referer, true);
+                    out += "\",\"user_agent\":\"";
+                    AppendEscaped(out, record.userAgent, true);
+                    out += "\"}\n";
+                    return;
+                }
+
+                out += AddressString(record);
+                out += " - - ";
+                out += m_CachedClf;
+                out += " \"";
+                AppendEscaped(out, record.method, false);
+                out.push_back(' ');
+                AppendEscaped(out, record.path, false);
+                out += " " + version + "\" " + std::to_string(record.status) + " " + std::to_string(record.bytesSent);
+                if (m_Options.format == AccessLogFormat::Combined)
+                {
+                    out += " \"";
+                    AppendEscaped(out, record.referer[0] ? record.referer : "-", false);
+                    out += "\" \"";
+                    AppendEscaped(out, record.userAgent[0] ? record.userAgent : "-", false);
+                    out += "\"";
+                }
+                out.push_back('\n');
+            }
+
+        private:
+            AccessLogOptions m_Options;
+            const uint64_t m_Id;
+            std::FILE* m_File = nullptr;
+            std::thread m_Thread;
+            mutable std::mutex m_Mutex;
+            std::condition_variable m_WakeCv;
+            bool m_Stop = false;
+            std::atomic<bool> m_ReopenRequested{false};
+            std::vector<std::unique_ptr<AccessLogRing>> m_Rings;
+            std::time_t m_CachedSecond = -1;
+            std::string m_CachedClf;
+            std::string m_CachedIso;
+        };
+
+#if defined(SIMPLE_HTTP_REGISTERED_BUFFERS)
+        // Fixed size buffers registered once with the io_context. With the
+        // io_uring backend reads and writes into them are issued as
+        // read_fixed / write_fixed and skip the per-operation page pinning.
+        // Slots are taken on the io thread and may be given back from any.
+        class RegisteredBufferPool
+        {
+        public:
+            RegisteredBufferPool(asio::io_context& context, std::size_t count, std::size_t size) :
+                m_Size(size), m_Memory(count * size), m_Registration(context, Slices(m_Memory, count, size))
+            {
+                m_Free.reserve(count);
+                for (std::size_t slot = count; slot > 0; slot--)
+                    m_Free.push_back(static_cast<int>(slot - 1));
+            }
+
+            // -1 when every slot is in use, the caller falls back to its own buffers
+            int Acquire()
+            {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                if (m_Free.empty())
+                    return -1;
+                int slot = m_Free.back();
+                m_Free.pop_back();
+                return slot;
+            }
+
+            void Release(int slot)
+            {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                m_Free.push_back(slot);
+            }
+
+            asio::mutable_registered_buffer Buffer(int slot)
+            {
+                return m_Registration[static_cast<std::size_t>(slot)];
+            }
+
+            std::size_t BufferSize() const { return m_Size; }
+
+        private:
+            static std::vector<asio::mutable_buffer> Slices(std::vector<char>& memory, std::size_t count, std::size_t size)
+            {
+                std::vector<asio::mutable_buffer> slices;
+                for (std::size_t slot = 0; slot < count; slot++)
+                    slices.push_back(asio::buffer(memory.data() + slot * size, size));
+                return slices;
+            }
+
+        private:
+            std::size_t m_Size;
+            std::vector<char> m_Memory;
+            asio::buffer_registration<std::vector<asio::mutable_buffer>> m_Registration;
+            std::mutex m_Mutex;
+            std::vector<int> m_Free;
+        };
+#endif
+
+        // Serialized response kept by the ResponseCache. The value of its
+        // Connection header is replaced per request when sent, and an Age
+        // header is added before the end of the headers. Date stays the
+        // time the response was generated (RFC 9111 5.6.7).
+        struct CachedResponse
+        {
+            std::string data; // Status line, headers and body
+            std::size_t connectionOffset = 0;
+            std::size_t connectionLength = 0;
+            std::size_t headersEnd = 0; // Offset of the empty line ending the headers
+            std::chrono::steady_clock::time_point generated;
+            uint16_t status = 0;
+        };
+
+        // Requests in flight by key, split in segments by key hash. The
+        // first request for a key leads it and runs the handler, the ones
+        // joining before it completes wait for its response.
+        class SingleFlight
+        {
+        public:
+            using Entry = std::shared_ptr<const CachedResponse>;
+            // Gets the leader's response, or null when it couldn't be
+            // shared and the waiter must run the handler.
+            using Waiter = std::function<void(Entry)>;
+
+            // True when the caller leads key and must Complete it.
+            // makeWaiter only runs otherwise.
+            template<typename MakeWaiter>
+            bool Join(const std::string& key, MakeWaiter&& makeWaiter)
+            {
+                Segment& segment = SegmentOf(key);
+                std::lock_guard<std::mutex> lock(segment.mutex);
+                auto flight = segment.flights.find(key);
+                if (flight != segment.flights.end())
+                {
+                    flight->second.push_back(makeWaiter());
+                    m_Coalesced.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+                segment.flights.emplace(key, std::vector<Waiter>());
+                m_Leaders.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+
+            // Ends the flight of key and hands entry to its waiters.
+            void Complete(const std::string& key, Entry entry)
+            {
+                Segment& segment = SegmentOf(key);
+                std::vector<Waiter> waiters;
+                {
+                    std::lock_guard<std::mutex> lock(segment.mutex);
+                    auto flight = segment.flights.find(key);
+                    if (flight == segment.flights.end())
+                        return;
+                    waiters = std::move(flight->second);
+                    segment.flights.erase(flight);
+                }
+                for (auto& waiter : waiters)
+                    waiter(entry);
+            }
+
+            CoalescingStats Stats() const
+            {
+                CoalescingStats stats;
+                stats.leaders = m_Leaders.load(std::memory_order_relaxed);
+                stats.coalesced = m_Coalesced.load(std::memory_order_relaxed);
+                return stats;
+            }
+
+        private:
+            static constexpr std::size_t SegmentCount = 16;
+
+            struct Segment
+            {
+                std::mutex mutex;
+                std::unordered_map<std::string, std::vector<Waiter>> flights;
+            };
+
+            Segment& SegmentOf(const std::string& key)
+            {
+                return m_Segments[std::hash<std::string>()(key) % SegmentCount];
+            }
+
+        private:
+            std::array<Segment, SegmentCount> m_Segments;
+            std::atomic<uint64_t> m_Leaders{0};
+            std::atomic<uint64_t> m_Coalesced{0};
+        };
+
+        // Serialized responses by key, split in segments by key hash, each
+        // with its own lock, share of the byte budget and CLOCK hand.
+        // Misses are left to the caller, which coalesces them through a
+        // SingleFlight.
+        class ResponseCache
+        {
+        public:
+            using Clock = std::chrono::steady_clock;
+            using Entry = std::shared_ptr<const CachedResponse>;
+
+            enum LookupResult
+            {
+                Hit,     // entry is set
+                Refresh, // The entry is stale: run the handler, then Complete
+                Miss
+            };
+
+            explicit ResponseCache(std::size_t maxBytes) :
+                m_SegmentBytes(std::max<std::size_t>(1, maxBytes / SegmentCount))
+            {
+            }
+
+            // A stale entry is refreshed by a single request at a time,
+            // the others are served it meanwhile.
+            LookupResult Lookup(const std::string& key, Entry& entry)
+            {
+                Segment& segment = SegmentOf(key);
+                auto now = Clock::now();
+                std::lock_guard<std::mutex> lock(segment.mutex);
+                auto found = segment.index.find(key);
+                if (found != segment.index.end())
+                {
+                    Slot& slot = segment.slots[found->second];
+                    if (now < slot.fresh)
+                    {
+                        slot.referenced = true;
+                        entry = slot.entry;
+                        m_Hits.fetch_add(1, std::memory_order_relaxed);
+                        return Hit;
+                    }
+                    if (now < slot.stale)
+                    {
+                        if (slot.refreshing)
+                        {
+                            entry = slot.entry;
+                            m_StaleHits.fetch_add(1, std::memory_order_relaxed);
+                            return Hit;
+                        }
+                        slot.refreshing = true;
+                        m_Misses.fetch_add(1, std::memory_order_relaxed);
+                        return Refresh;
+                    }
+                }
+                m_Misses.fetch_add(1, std::memory_order_relaxed);
+                return Miss;
+            }
+
+            // Stores entry for ttl unless it is null or ttl is 0, and ends
+            // a refresh of key started by Lookup.
+            void Complete(const std::string& key, const Entry& entry, std::chrono::milliseconds ttl,
+                std::chrono::milliseconds stale)
+            {
+                Segment& segment = SegmentOf(key);
+                std::lock_guard<std::mutex> lock(segment.mutex);
+                if (entry && ttl.count() > 0)
+                {
+                    auto now = Clock::now();
+                    Store(segment, key, entry, now + ttl, now + ttl + stale);
+                    return;
+                }
+                auto found = segment.index.find(key);
+                if (found != segment.index.end())
+                    segment.slots[found->second].refreshing = false;
+            }
+
+            ResponseCacheStats Stats()
+            {
+                ResponseCacheStats stats;
+                stats.hits = m_Hits.load(std::memory_order_relaxed);
+                stats.staleHits = m_StaleHits.load(std::memory_order_relaxed);
+                stats.misses = m_Misses.load(std::memory_order_relaxed);
+                stats.evictions = m_Evictions.load(std::memory_order_relaxed);
+                for (auto& segment : m_Segments)
+                {
+                    std::lock_guard<std::mutex> lock(segment.mutex);
+                    stats.entries += segment.index.size();
+                    stats.bytes += segment.bytes;
+                }
+                return stats;
+            }
+
+        private:
+            static constexpr std::size_t SegmentCount = 16;
+
+            struct Slot
+            {
+                std::string key;
+                Entry entry; // Null when the slot is free
+                std::size_t size = 0;
+                Clock::time_point fresh;
+                Clock::time_point stale;
+                bool referenced = false;
+                bool refreshing = false; // A request is refreshing the stale entry
+            };
+
+            struct Segment
+            {
+                std::mutex mutex;
+                std::unordered_map<std::string, std::size_t> index; // Slot of each key
+                std::vector<Slot> slots;
+                std::vector<std::size_t> freeSlots;
+                std::size_t hand = 0;
+                std::size_t bytes = 0;
+            };
+
+            Segment& SegmentOf(const std::string& key)
+            {
+                return m_Segments[std::hash<std::string>()(key) % SegmentCount];
+            }
+
+            void Store(Segment& segment, const std::string& key, const Entry& entry, Clock::time_point fresh,
+                Clock::time_point stale)
+            {
+                std::size_t size = key.size() + entry->data.size() + sizeof(Slot);
+                auto found = segment.index.find(key);
+                if (found != segment.index.end())
+                    Free(segment, found->second);
+                if (size > m_SegmentBytes)
+                    return;
+                while (segment.bytes + size > m_SegmentBytes)
+                    Evict(segment);
+
+                std::size_t index;
+                if (!segment.freeSlots.empty())
+                {
+                    index = segment.freeSlots.back();
+                    segment.freeSlots.pop_back();
+                }
+                else
+                {
+                    index = segment.slots.size();
+                    segment.slots.emplace_back();
+                }
+                segment.slots[index] = Slot{key, entry, size, fresh, stale, false, false};
+                segment.index.emplace(key, index);
+                segment.bytes += size;
+            }
+
+            // Second chance: referenced entries still usable survive a turn
+            // of the hand.
+            void Evict(Segment& segment)
+            {
+                auto now = Clock::now();
+                while (true)
+                {
+                    std::size_t index = segment.hand;
+                    segment.hand = (segment.hand + 1) % segment.slots.size();
+                    Slot& slot = segment.slots[index];
+                    if (!slot.entry)
+                        continue;
+                    if (slot.referenced && now < slot.stale)
+                    {
+                        slot.referenced = false;
+                        continue;
+                    }
+                    Free(segment, index);
+                    m_Evictions.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+            }
+
+            void Free(Segment& segment, std::size_t index)
+            {
+                Slot& slot = segment.slots[index];
+                segment.bytes -= slot.size;
+                segment.index.erase(slot.key);
+                slot = Slot();
+                segment.freeSlots.push_back(index);
+            }
+
+        private:
+            std::size_t m_SegmentBytes;
+            std::array<Segment, SegmentCount> m_Segments;
+            std::atomic<uint64_t> m_Hits{0};
+            std::atomic<uint64_t> m_StaleHits{0};
+            std::atomic<uint64_t> m_Misses{0};
+            std::atomic<uint64_t> m_Evictions{0};
+        };
+
+        // A worker thread and its io_context, serving a share of the
+        // connections. The first shard runs on the server's own context.
+        struct Shard
+        {
+            asio::io_context* context = nullptr;
+            std::unique_ptr<asio::io_context> ownContext;
+            std::thread thread;
+            std::optional<asio::executor_work_guard<asio::io_context::executor_type>> work; // Released by the drain
+            std::atomic<std::size_t> connections{0}; // Open sessions
+            // Started sessions, walked by the drain. Sessions may be freed
+            // on the offload threads, hence the mutex.
+            std::mutex sessionsMutex;
+            std::unordered_map<Session*, std::weak_ptr<Session>> sessions;
+#if defined(SIMPLE_HTTP_REGISTERED_BUFFERS)
+            std::unique_ptr<RegisteredBufferPool> registeredBuffers; // Registered with this shard's context
+#endif
+
+            void AddSession(const std::shared_ptr<Session>& session)
+            {
+                std::lock_guard<std::mutex> lock(sessionsMutex);
+                sessions.emplace(session.get(), session);
+            }
+
+            void RemoveSession(Session* session)
+            {
+                std::lock_guard<std::mutex> lock(sessionsMutex);
+                sessions.erase(session);
+            }
+
+            std::vector<std::shared_ptr<Session>> Sessions()
+            {
+                std::lock_guard<std::mutex> lock(sessionsMutex);
+                std::vector<std::shared_ptr<Session>> alive;
+                for (auto& [pointer, session] : sessions)
+                    if (auto locked = session.lock())
+                        alive.push_back(std::move(locked));
+                return alive;
+            }
+        };
+    }
+
+    class HttpServer
+    {
+    public:
+        // Listens on address:port, like Listen(address, port).
+        HttpServer(const std::string& address, uint_least16_t port);
+        // Without a listener, added by Listen, ListenUnix or ListenTls.
+        HttpServer();
+        // Waits for the network threads, which only end after a drain.
+        ~HttpServer();
+        void Start();
+        // Stops accepting and lets the requests in flight finish. Their
+        // responses carry Connection: close and idle keep-alive connections
+        // are closed at once; connections still open after deadline are
+        // closed. Returns when the network threads are done. Must not be
+        // called from a handler.
+        void Drain(std::chrono::milliseconds deadline);
+        // Drain with a default deadline. Drain(0ms) closes every
+        // connection at once instead.
+        void Stop(std::chrono::milliseconds deadline = std::chrono::seconds(30));
+        // Blocks until the network threads end, i.e. until a drain
+        // completes.
+        void Wait();
+        // Starts a drain with deadline when signalNumber (e.g. SIGTERM) is
+        // raised. The threads blocked in Wait or in the destructor return
+        // once it completes.
+        void DrainOnSignal(int signalNumber, std::chrono::milliseconds deadline = std::chrono::seconds(30));
+        void Get(const std::string& pathPattern, CallbackHandler requestHandler, RouteOptions options = RouteOptions());
+        void Get(const std::string& pathPattern, DeferredCallbackHandler requestHandler, RouteOptions options = RouteOptions());
+        void Post(const std::string& pathPattern, CallbackHandler requestHandler, RouteOptions options = RouteOptions());
+        void Post(const std::string& pathPattern, DeferredCallbackHandler requestHandler, RouteOptions options = RouteOptions());
+        void Put(const std::string& pathPattern, CallbackHandler requestHandler, RouteOptions options = RouteOptions());
+        void Put(const std::string& pathPattern, DeferredCallbackHandler requestHandler, RouteOptions options = RouteOptions());
+        void Delete(const std::string& pathPattern, CallbackHandler requestHandler, RouteOptions options = RouteOptions());
+        void Delete(const std::string& pathPattern, DeferredCallbackHandler requestHandler, RouteOptions options = RouteOptions());
+        void Head(const std::string& pathPattern, CallbackHandler requestHandler, RouteOptions options = RouteOptions());
+        void Head(const std::string& pathPattern, DeferredCallbackHandler requestHandler, RouteOptions options = RouteOptions());
+        void Options(const std::string& pathPattern, CallbackHandler requestHandler, RouteOptions options = RouteOptions());
+        void Options(const std::string& pathPattern, DeferredCallbackHandler requestHandler, RouteOptions options = RouteOptions());
+        void Patch(const std::string& pathPattern, CallbackHandler requestHandler, RouteOptions options = RouteOptions());
+        void Patch(const std::string& pathPattern, DeferredCallbackHandler requestHandler, RouteOptions options = RouteOptions());
+        // Size of the pool running routes registered with RouteOptions::offload.
+        // Requests beyond maxQueueDepth waiting tasks are answered with 503.
+        // Must be called before Start.
+        void SetOffloadPool(std::size_t threads, std::size_t maxQueueDepth);
+        // Number of threads serving connections, each running its own
+        // io_context. Listeners accept on the first one and hand the
+        // connections out by balancing; handlers may then run on several
+        // threads at once. Must be called before Start.
+        void SetWorkerThreads(std::size_t threads, ConnectionBalancing balancing = ConnectionBalancing::RoundRobin);
+        // Memory used by the responses of routes with RouteOptions::cache,
+        // 64 MiB by default. Must be called before Start.
+        void SetResponseCache(std::size_t maxBytes);
+        ResponseCacheStats CacheStats() const;
+        // Requests sharing a response on routes with a cache or
+        // RouteOptions::coalesce.
+        CoalescingStats CoalesceStats() const;
+        // Serves the request metrics in Prometheus text format on GET path.
+        // Must be called before Start.
+        void EnableMetrics(const std::string& path = "/metrics");
+        // Current metrics in Prometheus text format.
+        std::string MetricsText() const;
+        // Latency of the request phases (accept, first byte, headers parsed,
+        // handler start and end, write complete) merged over all threads.
+        std::vector<PhaseSummary> PhaseStats() const;
+        std::string PhaseReport() const;
+        // Prints PhaseReport to stderr every time signalNumber is raised.
+        void DumpPhaseStatsOnSignal(int signalNumber);
+        // Logs every response through a background writer thread. Records
+        // are dropped, never waited for, when a thread's ring is full.
+        // Must be called before Start.
+        void EnableAccessLog(const AccessLogOptions& options = AccessLogOptions());
+        uint64_t DroppedAccessLogRecords() const;
+        // Must be called before Start.
+        void SetLimits(const ServerLimits& limits);
+        // Renders the error responses (400, 404, 405, 413, 414, 431, 501...)
+        // instead of the built-in ones. The handler gets res.status already
+        // set to the error and may change the body and headers.
+        void SetErrorHandler(CallbackHandler handler);
+        // Answers CORS preflights and adds Access-Control-Allow-Origin to
+        // the responses to allowed origins. Must be called before Start.
+        void EnableCors(const CorsOptions& options);
+#if defined(SIMPLE_HTTP_ZLIB)
+        // Compresses the responses to clients accepting gzip or deflate.
+        // Must be called before Start.
+        void EnableCompression(const CompressionOptions& options = CompressionOptions());
+#endif
+        // Number and size of the buffers registered with the kernel by the
+        // io_uring build (premake5 gmake2 --io_uring). Every connection
+        // holds one while open; 0 disables them. Ignored by other builds.
+        // Must be called before Start.
+        void SetRegisteredBuffers(std::size_t count, std::size_t size);
+        // Every listener feeds the same routes and threads. They bind when
+        // called, throwing on failure, and accept from Start on.
+        // IPv4 or IPv6 address, "::" listens on both.
+        void Listen(const std::string& address, uint_least16_t port, const ListenOptions& options = ListenOptions());
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+        // Unix domain socket at path, created by the call and removed with
+        // the server.
+        void ListenUnix(const std::string& path, const ListenOptions& options = ListenOptions());
+#endif
+#if defined(SIMPLE_HTTP_TLS)
+        // HTTPS on address:port. Also throws when the certificate or key
+        // can't be loaded.
+        void ListenTls(const std::string& address, uint_least16_t port, const TlsOptions& tls,
+            const ListenOptions& options = ListenOptions());
+#endif
+#if defined(SIMPLE_HTTP_LISTENER_HANDOFF)
+        // Listens on a TCP or Unix domain socket bound by another process,
+        // e.g. from ReceiveListenerFds or InheritedListenerFds.
+        void ListenFd(int fd, const ListenOptions& options = ListenOptions());
+#if defined(SIMPLE_HTTP_TLS)
+        void ListenTlsFd(int fd, const TlsOptions& tls, const ListenOptions& options = ListenOptions());
+#endif
+        // Listening sockets in the order the listeners were added, made
+        // inheritable for a process started with exec. They accept until
+        // the drain, which then leaves Unix domain socket files in place.
+        std::vector<int> ListenerFds();
+        // Sends the listening sockets to the first process of the same
+        // user connecting to the Unix domain socket at path, with
+        // ReceiveListenerFds, and then drains with deadline. The socket
+        // file is only accessible to its owner.
+        void ServeHandOff(const std::string& path, std::chrono::milliseconds deadline = std::chrono::seconds(30));
+        // Listening sockets of the server serving a hand off at path,
+        // empty when there is none.
+        static std::vector<int> ReceiveListenerFds(const std::string& path);
+        // Listening sockets listed in variable, comma separated, by the
+        // process that started this one.
+        static std::vector<int> InheritedListenerFds(const char* variable = "SIMPLE_HTTP_LISTEN_FDS");
+#endif
+        // Mounts a StaticRouter. Its routes are matched before the routes
+        // registered with Get, Post, Put and Delete and always run on the
+        // io thread. Must be called before Start.
+        template<typename Router>
+        void Mount()
+        {
+            Details::MountedRouter router;
+            router.find = &Router::Find;
+            router.invoke = &Router::Invoke;
+            for (std::size_t i = 0; i < Router::RouteCount; i++)
+                router.routes.emplace_back(Router::Methods[i], Router::Paths[i]);
+            m_StaticRouters.push_back(std::move(router));
+        }
+
+    private:
+        void AddRoute(Method method, const std::string& pathPattern, CallbackHandler requestHandler, RouteOptions options);
+        void AddRoute(Method method, const std::string& pathPattern, DeferredCallbackHandler requestHandler, RouteOptions options);
+        // Methods with a route for path, formatted for the Allow header.
+        // HEAD is implied by GET and OPTIONS is always allowed.
+        std::string AllowedMethods(const std::string& path) const;
+        void BuildPathRoutes();
+        bool IsAllowedOrigin(const std::string& origin) const;
+        // Shard for the next accepted connection. Round-robin moves on
+        // once AdvanceShard tells a connection was accepted into it. Only
+        // called on the listeners' thread.
+        Details::Shard& NextShard();
+        void AdvanceShard();
+        void WaitDumpSignal();
+        void WaitAccessLogSignal();
+        void WaitDrainSignal();
+#if defined(SIMPLE_HTTP_LISTENER_HANDOFF)
+        // Listening sockets for another process, still close-on-exec
+        std::vector<int> HandOffFds();
+        void WaitHandOff();
+        void CloseHandOff();
+#endif
+        // Thread safe, the drain itself runs on the listeners' thread.
+        void BeginDrain(std::chrono::milliseconds deadline);
+        // Called by the sessions freed while draining, from any thread.
+        void SessionClosedWhileDraining();
+        // Lets the network threads end once their queues run dry; force
+        // first closes every session left.
+        void FinishDrain(bool force);
+
+    private:
+        asio::io_context m_IoContext;
+        asio::steady_timer m_DrainTimer{m_IoContext};
+        std::atomic<bool> m_Draining{false};
+        bool m_DrainFinished = false; // Only used on the listeners' thread
+        std::vector<std::unique_ptr<Details::Listener>> m_Listeners;
+        std::unique_ptr<Details::WorkStealingPool> m_OffloadPool;
+        std::unique_ptr<Details::ResponseCache> m_ResponseCache; // Created by Start for routes with a cache
+        std::unique_ptr<Details::SingleFlight> m_SingleFlight;   // Created by Start for cached or coalesced routes
+        std::size_t m_ResponseCacheBytes = 64 * 1024 * 1024;
+        std::size_t m_OffloadThreads = std::max(1u, std::thread::hardware_concurrency());
+        std::size_t m_OffloadQueueDepth = 1024;
+        Details::Metrics m_Metrics;
+        std::string m_MetricsPath;
+        Details::PhaseHistograms m_PhaseHistograms;
+        std::unique_ptr<asio::signal_set> m_DumpSignals;
+        std::unique_ptr<Details::AccessLog> m_AccessLog;
+        std::unique_ptr<asio::signal_set> m_AccessLogSignals;
+        std::unique_ptr<asio::signal_set> m_DrainSignals;
+        std::chrono::milliseconds m_DrainSignalDeadline{0};
+#if defined(SIMPLE_HTTP_LISTENER_HANDOFF)
+        std::unique_ptr<asio::local::stream_protocol::acceptor> m_HandOffAcceptor;
+        std::string m_HandOffPath;
+        std::chrono::milliseconds m_HandOffDeadline{0};
+#endif
+
+        std::array<std::vector<Handler>, MethodCount> m_Handlers; // Indexed by Method
+        std::vector<Details::MountedRouter> m_StaticRouters;
+        std::unordered_map<std::string, Details::PathRoutes> m_PathRoutes; // Built by Start
+        std::unique_ptr<CorsOptions> m_Cors;
+#if defined(SIMPLE_HTTP_ZLIB)
+        std::unique_ptr<CompressionOptions> m_Compression;
+#endif
+        std::vector<std::unique_ptr<Details::Shard>> m_Shards; // Created by Start
+        std::size_t m_WorkerThreads = 1;
+        ConnectionBalancing m_Balancing = ConnectionBalancing::RoundRobin;
+        std::size_t m_NextShard = 0;
+        std::size_t m_RegisteredBufferCount = 256;
+        std::size_t m_RegisteredBufferSize = 16 * 1024;
+        ServerLimits m_Limits;
+        CallbackHandler m_ErrorHandler;
+        std::size_t m_OptionsRouteId = 0;
+        std::vector<MiddlewareHandler> m_Middlewares;
+        std::shared_ptr<std::thread> m_ContextThread;
+
+        template<typename Stream> friend class Details::RequestSession;
+        template<typename Protocol> friend class Details::SocketListener;
+    };
+
+    namespace Details
+    {
+        constexpr const char* StatusMessage(uint16_t status) {
+            switch (status) {
+            case 100: return "Continue";
+            case 101: return "Switching Protocol";
+            case 102: return "Processing";
+            case 103: return "Early Hints";
+            case 200: return "OK";
+            case 201: return "Created";
+            case 202: return "Accepted";
+            case 203: return "Non-Authoritative Information";
+            case 204: return "No Content";
+            case 205: return "Reset Content";
+            case 206: return "Partial Content";
+            case 207: return "Multi-Status";
+            case 208: return "Already Reported";
+            case 226: return "IM Used";
+            case 300: return "Multiple Choice";
+            case 301: return "Moved Permanently";
+            case 302: return "Found";
+            case 303: return "See Other";
+            case 304: return "Not Modified";
+            case 305: return "Use Proxy";
+            case 306: return "unused";
+            case 307: return "Temporary Redirect";
+            case 308: return "Permanent Redirect";
+            case 400: return "Bad Request";
+            case 401: return "Unauthorized";
+            case 402: return "Payment Required";
+            case 403: return "Forbidden";
+            case 404: return "Not Found";
+            case 405: return "Method Not Allowed";
+            case 406: return "Not Acceptable";
+            case 407: return "Proxy Authentication Required";
+            case 408: return "Request Timeout";
+            case 409: return "Conflict";
+            case 410: return "Gone";
+            case 411: return "Length Required";
+            case 412: return "Precondition Failed";
+            case 413: return "Payload Too Large";
+            case 414: return "URI Too Long";
+            case 415: return "Unsupported Media Type";
+            case 416: return "Range Not Satisfiable";
+            case 417: return "Expectation Failed";
+            case 418: return "I'm a teapot";
+            case 421: return "Misdirected Request";
+            case 422: return "Unprocessable Entity";
+            case 423: return "Locked";
+            case 424: return "Failed Dependency";
+            case 425: return "Too Early";
+            case 426: return "Upgrade Required";
+            case 428: return "Precondition Required";
+            case 429: return "Too Many Requests";
+            case 431: return "Request Header Fields Too Large";
+            case 451: return "Unavailable For Legal Reasons";
+            case 501: return "Not Implemented";
+            case 502: return "Bad Gateway";
+            case 503: return "Service Unavailable";
+            case 504: return "Gateway Timeout";
+            case 505: return "HTTP Version Not Supported";
+            case 506: return "Variant Also Negotiates";
+            case 507: return "Insufficient Storage";
+            case 508: return "Loop Detected";
+            case 510: return "Not Extended";
+            case 511: return "Network Authentication Required";
+
+            default:
+            case 500: return "Internal Server Error";
+            }
+        }
+
+        constexpr std::size_t StatusLinesSize()
+        {
+            std::size_t size = 0;
+            for (uint16_t status = 100; status <= 599; status++)
+            {
+                const char* message = StatusMessage(status);
+                std::size_t length = 0;
+                while (message[length])
+                    length++;
+                size += 15 + length; // "HTTP/1.1 000 " and CRLF
+            }
+            return size;
+        }
+
+        // Complete "HTTP/1.1 <status> <message>\r\n" lines for every status
+        // from 100 to 599, rendered at compile time into one static buffer.
+        class StatusLineTable
+        {
+        public:
+            static constexpr uint16_t FirstStatus = 100;
+            static constexpr uint16_t LastStatus = 599;
+
+            constexpr StatusLineTable() :
+                m_Data(), m_Offsets()
+            {
+                std::size_t offset = 0;
+                for (uint16_t status = FirstStatus; status <= LastStatus; status++)
+                {
+                    m_Offsets[status - FirstStatus] = static_cast<uint16_t>(offset);
+                    offset = Render(status, m_Data, offset);
+                }
+                m_Offsets[LastStatus - FirstStatus + 1] = static_cast<uint16_t>(offset);
+            }
+
+            // The line of an unknown status carries the message of 500, as
+            // StatusMessage does. Statuses outside of 100-599 get a 500 line.
+            constexpr std::string_view operator[](uint16_t status) const
+            {
+                if (status < FirstStatus || status > LastStatus)
+                    status = 500;
+                std::size_t begin = m_Offsets[status - FirstStatus];
+                std::size_t end = m_Offsets[status - FirstStatus + 1];
+                return std::string_view(m_Data + begin, end - begin);
+            }
+
+        private:
+            // Writes the line of status at offset and returns the offset past it.
+            static constexpr std::size_t Render(uint16_t status, char* out, std::size_t offset)
+            {
+                const char* prefix = "HTTP/1.1 ";
+                for (std::size_t i = 0; prefix[i]; i++)
+                    out[offset++] = prefix[i];
+                out[offset++] = static_cast<char>('0' + status / 100);
+                out[offset++] = static_cast<char>('0' + status / 10 % 10);
+                out[offset++] = static_cast<char>('0' + status % 10);
+                out[offset++] = ' ';
+                const char* message = StatusMessage(status);
+                for (std::size_t i = 0; message[i]; i++)
+                    out[offset++] = message[i];
+                out[offset++] = '\r';
+                out[offset++] = '\n';
+                return offset;
+            }
+
+        private:
+            char m_Data[StatusLinesSize()];
+            uint16_t m_Offsets[LastStatus - FirstStatus + 2];
+        };
+
+        inline constexpr StatusLineTable STATUS_LINES;
+
+        constexpr std::string_view StatusLine(uint16_t status)
+        {
+            return STATUS_LINES[status];
+        }
+
+        constexpr auto END_TOKEN = "\r\n\r\n"; 
+        // Check if a byte is an HTTP character.
+        inline bool IsChar(int c)
+        {
+            return c >= 0 && c <= 127;
+        }
+
+        // Check if a byte is an HTTP control character.
+        inline bool IsControl(int c)
+        {
+            return (c >= 0 && c <= 31) || (c == 127);
+        }
+
+        // Check if a byte is defined as an HTTP special character.
+        inline bool IsSpecial(int c)
+        {
+            switch (c)
+            {
+            case '(': case ')': case '<': case '>': case '@':
+            case ',': case ';': case ':': case '\\': case '"':
+            case '/': case '[': case ']': case '?': case '=':
+            case '{': case '}': case ' ': case '\t':
+                return true;
+            default:
+                return false;
+            }
+        }
+
+        // Check if a byte is a digit.
+        inline bool IsDigit(int c)
+        {
+            return c >= '0' && c <= '9';
+        }
+
+        inline bool CheckIfConnection(const std::pair<std::string, std::string>& item)
+        {
+            return strcasecmp(item.first.c_str(), "Connection") == 0;
+        }
+
+        // The current state of the parser.
+        enum State
+        {
+            RequestMethodStart,
+            RequestMethod,
+            RequestUriStart,
+            RequestUri,
+            RequestHttpVersion_h,
+            RequestHttpVersion_ht,
+            RequestHttpVersion_htt,
+            RequestHttpVersion_http,
+            RequestHttpVersion_slash,
+            RequestHttpVersion_majorStart,
+            RequestHttpVersion_major,
+            RequestHttpVersion_minorStart,
+            RequestHttpVersion_minor,
+
+            ResponseStatusStart,
+            ResponseHttpVersion_ht,
+            ResponseHttpVersion_htt,
+            ResponseHttpVersion_http,
+            ResponseHttpVersion_slash,
+            ResponseHttpVersion_majorStart,
+            ResponseHttpVersion_major,
+            ResponseHttpVersion_minorStart,
+            ResponseHttpVersion_minor,
+            ResponseHttpVersion_spaceAfterVersion,
+            ResponseHttpVersion_statusCodeStart,
+            ResponseHttpVersion_spaceAfterStatusCode,
+            ResponseHttpVersion_statusTextStart,
+            ResponseHttpVersion_newLine,
+
+            HeaderLineStart,
+            HeaderLws,
+            HeaderName,
+            SpaceBeforeHeaderValue,
+            HeaderValue,
+            ExpectingNewline_2,
+            ExpectingNewline_3,
+
+            Post,
+        };
+
+        enum ParseResult
+        {
+            ParsingCompleted,
+            ParsingIncompleted,
+            ParsingError
+        };
+
+        enum ParseMode
+        {
+            ParseWholeRequest, // Completes on the first body byte, reads Content-Length of POST and PUT only
+            ParseHeadersOnly   // Completes at the end of the headers, reads Content-Length of every method
+        };
+
+        // Digits only, at most 4 GiB - 1.
+        inline bool ParseContentLength(const std::string& value, size_t& length)
+        {
+            if (value.empty() || value.size() > 10)
+                return false;
+            uint64_t parsed = 0;
+            for (char c : value)
+            {
+                if (!IsDigit(c))
+                    return false;
+                parsed = parsed * 10 + (c - '0');
+            }
+            if (parsed > UINT32_MAX)
+                return false;
+            length = static_cast<size_t>(parsed);
+            return true;
+        }
+
+        inline ParseResult ParseRequest(const std::string& requestData, Request& req, ParseMode mode = ParseWholeRequest)
+        {
+            // Parser from https://github.com/nekipelov/httpparser
+            std::vector<std::pair<std::string, std::string>> headers;
+            std::vector<std::pair<std::string, std::string>> params;
+            State state = RequestMethodStart;
+            bool chunked = false;
+            size_t contentSize = 0;
+            bool hasContentLength = false;
+            bool hasTransferEncoding = false;
+            size_t methodLength = 0; // The method token starts the request
+            
+            for (char input : requestData)
+            {
+                switch (state)
+                {
+                case RequestMethodStart:
+                    if( !IsChar(input) || IsControl(input) || IsSpecial(input) )
+                    {
+                        return ParsingError;
+                    }
+                    else
+                    {
+                        state = RequestMethod;
+                        methodLength = 1;
+                    }
+                    break;
+                case RequestMethod:
+                    if( input == ' ' )
+                    {
+                        // Classified where it lies, copied once
+                        std::string_view method(requestData.data(), methodLength);
+                        req.methodType = ParseMethod(method);
+                        req.method.assign(method);
+                        state = RequestUriStart;
+                    }
+                    else if( !IsChar(input) || IsControl(input) || IsSpecial(input) )
+                    {
+                        return ParsingError;
+                    }
+                    else
+                    {
+                        methodLength++;
+                    }
+                    break;
+                case RequestUriStart:
+                    if( IsControl(input) )
+                    {
+                        return ParsingError;
+                    }
+                    else
+                    {
+                        state = RequestUri;
+                        req.path.push_back(input);
+                    }
+                    break;
+                case RequestUri:
+                    if( input == ' ' )
+                    {
+                        state = RequestHttpVersion_h;
+                    }
+                    else if (input == '\r')
+                    {
+                        req.versionMajor = 0;
+                        req.versionMinor = 9;
+
+                        return ParsingCompleted;
+                    }
+                    else if( IsControl(input) )
+                    {
+                        return ParsingError;
+                    }
+                    else
+                    {
+                        req.path.push_back(input);
+                    }
+                    break;
+                case RequestHttpVersion_h:
+                    if( input == 'H' )
+                    {
+                        state = RequestHttpVersion_ht;
+                    }
+                    else
+                    {
+                        return ParsingError;
+                    }
+                    break;
+                case RequestHttpVersion_ht:
+                    if( input == 'T' )
+                    {
+                        state = RequestHttpVersion_htt;
+                    }
+                    else
+                    {
+                        return ParsingError;
+                    }
+                    break;
+                case RequestHttpVersion_htt:
+                    if( input == 'T' )
+                    {
+                        state = RequestHttpVersion_http;
+                    }
+                    else
+                    {
+                        return ParsingError;
+                    }
+                    break;
+                case RequestHttpVersion_http:
+                    if( input == 'P' )
+                    {
+                        state = RequestHttpVersion_slash;
                     }
                     else
                     {
@@ -364,434 +2654,2635 @@ namespace Simple {
                 case RequestHttpVersion_slash:
                     if( input == '/' )
                     {
-                        req.versionMajor = 0;
-                        req.versionMinor = 0;
-                        state = RequestHttpVersion_majorStart;
+                        req.versionMajor = 0;
+                        req.versionMinor = 0;
+                        state = RequestHttpVersion_majorStart;
+                    }
+                    else
+                    {
+                        return ParsingError;
+                    }
+                    break;
+                case RequestHttpVersion_majorStart:
+                    if( IsDigit(input) )
+                    {
+                        req.versionMajor = input - '0';
+                        state = RequestHttpVersion_major;
+                    }
+                    else
+                    {
+                        return ParsingError;
+                    }
+                    break;
+                case RequestHttpVersion_major:
+                    if( input == '.' )
+                    {
+                        state = RequestHttpVersion_minorStart;
+                    }
+                    else if (IsDigit(input))
+                    {
+                        req.versionMajor = req.versionMajor * 10 + input - '0';
+                    }
+                    else
+                    {
+                        return ParsingError;
+                    }
+                    break;
+                case RequestHttpVersion_minorStart:
+                    if( IsDigit(input) )
+                    {
+                        req.versionMinor = input - '0';
+                        state = RequestHttpVersion_minor;
+                    }
+                    else
+                    {
+                        return ParsingError;
+                    }
+                    break;
+                case RequestHttpVersion_minor:
+                    if( input == '\r' )
+                    {
+                        state = ResponseHttpVersion_newLine;
+                    }
+                    else if( IsDigit(input) )
+                    {
+                        req.versionMinor = req.versionMinor * 10 + input - '0';
+                    }
+                    else
+                    {
+                        return ParsingError;
+                    }
+                    break;
+                case ResponseHttpVersion_newLine:
+                    if( input == '\n' )
+                    {
+                        state = HeaderLineStart;
+                    }
+                    else
+                    {
+                        return ParsingError;
+                    }
+                    break;
+                case HeaderLineStart:
+                    if( input == '\r' )
+                    {
+                        state = ExpectingNewline_3;
+                    }
+                    else if( !req.headers.empty() && (input == ' ' || input == '\t') )
+                    {
+                        state = HeaderLws;
+                    }
+                    else if( !IsChar(input) || IsControl(input) || IsSpecial(input) )
+                    {
+                        return ParsingError;
+                    }
+                    else
+                    {
+                        headers.push_back({});
+                        headers.back().first.reserve(16);
+                        headers.back().second.reserve(16);
+                        headers.back().first.push_back(input);
+                        state = HeaderName;
+                    }
+                    break;
+                case HeaderLws:
+                    if( input == '\r' )
+                    {
+                        state = ExpectingNewline_2;
+                    }
+                    else if( input == ' ' || input == '\t' )
+                    {
+                    }
+                    else if( IsControl(input) )
+                    {
+                        return ParsingError;
+                    }
+                    else
+                    {
+                        state = HeaderValue;
+                        headers.back().second.push_back(input);
+                    }
+                    break;
+                case HeaderName:
+                    if( input == ':' )
+                    {
+                        state = SpaceBeforeHeaderValue;
+                    }
+                    else if( !IsChar(input) || IsControl(input) || IsSpecial(input) )
+                    {
+                        return ParsingError;
                     }
                     else
                     {
-                        return ParsingError;
+                        headers.back().first.push_back(input);
                     }
                     break;
-                case RequestHttpVersion_majorStart:
-                    if( IsDigit(input) )
+                case SpaceBeforeHeaderValue:
+                    if( input == ' ' )
                     {
-                        req.versionMajor = input - '0';
-                        state = RequestHttpVersion_major;
+                        state = HeaderValue;
                     }
                     else
                     {
                         return ParsingError;
                     }
                     break;
-                case RequestHttpVersion_major:
-                    if( input == '.' )
+                case HeaderValue:
+                    if( input == '\r' )
                     {
-                        state = RequestHttpVersion_minorStart;
+                        if( mode == ParseHeadersOnly )
+                        {
+                            auto &h = headers.back();
+
+                            // Framing a proxy could read otherwise is refused (RFC 9112 6.3)
+                            if( strcasecmp(h.first.c_str(), "Content-Length") == 0 )
+                            {
+                                size_t length = 0;
+                                if( !ParseContentLength(h.second, length) || hasTransferEncoding ||
+                                    (hasContentLength && length != contentSize) )
+                                    return ParsingError;
+                                hasContentLength = true;
+                                contentSize = length;
+                                req.contentLength = static_cast<uint32_t>(contentSize);
+                            }
+                            else if( strcasecmp(h.first.c_str(), "Transfer-Encoding") == 0 )
+                            {
+                                if( hasContentLength )
+                                    return ParsingError;
+                                hasTransferEncoding = true;
+                            }
+                        }
+                        else if( req.methodType == Method::Post || req.methodType == Method::Put )
+                        {
+                            auto &h = headers.back();
+
+                            if( strcasecmp(h.first.c_str(), "Content-Length") == 0 )
+                            {
+                                contentSize = atoi(h.second.c_str());
+                                req.body.reserve( contentSize );
+                                req.contentLength = contentSize;
+                            }
+                            else if( strcasecmp(h.first.c_str(), "Transfer-Encoding") == 0 )
+                            {
+                                if(strcasecmp(h.second.c_str(), "chunked") == 0)
+                                    chunked = true;
+                            }
+                        }
+                        state = ExpectingNewline_2;
                     }
-                    else if (IsDigit(input))
+                    else if( IsControl(input) )
                     {
-                        req.versionMajor = req.versionMajor * 10 + input - '0';
+                        return ParsingError;
                     }
                     else
                     {
-                        return ParsingError;
+                        headers.back().second.push_back(input);
                     }
                     break;
-                case RequestHttpVersion_minorStart:
-                    if( IsDigit(input) )
+                case ExpectingNewline_2:
+                    if( input == '\n' )
                     {
-                        req.versionMinor = input - '0';
-                        state = RequestHttpVersion_minor;
+                        state = HeaderLineStart;
                     }
                     else
                     {
                         return ParsingError;
                     }
                     break;
-                case RequestHttpVersion_minor:
-                    if( input == '\r' )
+                case ExpectingNewline_3: {
+                    std::vector<std::pair<std::string, std::string>>::iterator it = std::find_if(headers.begin(),
+                                                                        headers.end(),
+                                                                        CheckIfConnection);
+
+                    if( it != headers.end() )
                     {
-                        state = ResponseHttpVersion_newLine;
+                        if( strcasecmp(it->second.c_str(), "Keep-Alive") == 0 )
+                        {
+                            // req.keepAlive = true;
+                        }
+                        else  // == Close
+                        {
+                            // req.keepAlive = false;
+                        }
                     }
-                    else if( IsDigit(input) )
+                    else
                     {
-                        req.versionMinor = req.versionMinor * 10 + input - '0';
+                        // if( req.versionMajor > 1 || (req.versionMajor == 1 && req.versionMinor == 1) )
+                        //     req.keepAlive = true;
                     }
-                    else
+
+                    if( mode == ParseHeadersOnly )
                     {
-                        return ParsingError;
+                        // The session reads the body
+                        if( input != '\n' )
+                            return ParsingError;
+                        for (auto& [name, value] : headers)
+                            req.headers[name] = std::move(value);
+                        for (auto& [name, value] : params)
+                            req.params[name] = std::move(value);
+                        return ParsingCompleted;
                     }
-                    break;
-                case ResponseHttpVersion_newLine:
-                    if( input == '\n' )
+                    else if( chunked )
                     {
-                        state = HeaderLineStart;
+                    }
+                    else if( contentSize == 0 )
+                    {
+                        if( input == '\n')
+                        {
+                            for (auto& [name, value] : headers)
+                                req.headers[name] = std::move(value);
+                            for (auto& [name, value] : params)
+                                req.params[name] = std::move(value);
+                            return ParsingCompleted;
+                        }
+                        else
+                            return ParsingError;
                     }
                     else
                     {
-                        return ParsingError;
+                        state = Post;
                     }
                     break;
-                case HeaderLineStart:
-                    if( input == '\r' )
+                }
+                case Post:
+                    if (true)
                     {
-                        state = ExpectingNewline_3;
+                        for (auto& [name, value] : headers)
+                            req.headers[name] = std::move(value);
+                        for (auto& [name, value] : params)
+                            req.params[name] = std::move(value);
                     }
-                    else if( !req.headers.empty() && (input == ' ' || input == '\t') )
+                    return ParsingCompleted;
+                    break;
+                default:
+                    return ParsingError;
+                }
+            }
+
+            return ParsingIncompleted;
+        }
+
+        inline const Handler* MatchRequest(const std::vector<Handler>& handlers, const Request& req)
+        {
+            for (auto& handler : handlers)
+                if (handler.path == req.path)
+                    return &handler;
+            return nullptr;
+        }
+
+        // Current time in the format of the Date header.
+        inline std::string_view HttpDate(char (&buffer)[32])
+        {
+            std::time_t now = std::time(0);
+            std::tm time;
+#if defined(_WIN32)
+            gmtime_s(&time, &now);
+#else
+            gmtime_r(&now, &time);
+#endif
+            return std::string_view(buffer, std::strftime(buffer, sizeof(buffer), "%a, %d %b %Y %T GMT", &time));
+        }
+
+        // Adds the server headers to the response and appends the header
+        // block and body to out. The status line is not included, it is
+        // written from the static StatusLine table.
+        inline void SerializeHeaders(Response& respond, std::string& out, bool includeBody = true, bool keepAlive = false)
+        {
+            respond.headers["Content-Type"] += "; charset=UTF-8";
+            respond.headers["Content-Length"] = std::to_string(respond.body.size());    
+            respond.headers["Connection"] = keepAlive ? "keep-alive" : "close";
+            respond.headers["Server"] = "SimpleHttpServer";
+            if (!respond.location.empty()) respond.headers["Location"] = respond.location;
+            char date[32];
+            respond.headers["Date"] = HttpDate(date);
+
+            std::size_t size = 2 + (includeBody ? respond.body.size() : 0);
+            for (auto& [name, value] : respond.headers)
+                size += name.size() + value.size() + 4;
+            out.reserve(out.size() + size);
+
+            for (auto& [name, value] : respond.headers)
+            {
+                out += name;
+                out += ": ";
+                out += value;
+                out += "\r\n";
+            }
+            out += "\r\n";
+            if (includeBody)
+                out += respond.body;
+        }
+
+        // Renders the complete response, status line included.
+        inline std::string SerializeResponse(Response& respond)
+        {
+            std::string out(StatusLine(respond.status));
+            SerializeHeaders(respond, out);
+            return out;
+        }
+
+        // Header lookup ignoring the case of the name.
+        inline const std::string* FindHeader(const Headers& headers, std::string_view name)
+        {
+            for (auto& [key, value] : headers)
+                if (key.size() == name.size() && strncasecmp(key.data(), name.data(), name.size()) == 0)
+                    return &value;
+            return nullptr;
+        }
+
+        // 204 answer to OPTIONS, cors adds the preflight headers. The
+        // allowed origin depends on the request and is added when sent.
+        inline std::string RenderOptionsResponse(const std::string& allow, const CorsOptions* cors)
+        {
+            std::string out(StatusLine(204));
+            out += "Allow: " + allow + "\r\n";
+            if (cors)
+            {
+                out += "Access-Control-Allow-Methods: " + allow + "\r\n";
+                if (!cors->allowHeaders.empty())
+                    out += "Access-Control-Allow-Headers: " + cors->allowHeaders + "\r\n";
+                out += "Access-Control-Max-Age: " + std::to_string(cors->maxAge) + "\r\n";
+                if (cors->allowCredentials)
+                    out += "Access-Control-Allow-Credentials: true\r\n";
+            }
+            out += "Server: SimpleHttpServer\r\n";
+            return out;
+        }
+
+        // Built-in error answer rendered once. head holds the status line
+        // and the headers except Connection and Date.
+        struct ErrorResponse
+        {
+            uint16_t status;
+            std::string head;
+            std::string body;
+        };
+
+        inline const ErrorResponse* FindErrorResponse(uint16_t status)
+        {
+            static const std::vector<ErrorResponse> responses = [] () {
+                std::vector<ErrorResponse> rendered;
+                for (uint16_t error : { 400, 404, 405, 413, 414, 431, 500, 501, 503 })
+                {
+                    ErrorResponse response;
+                    response.status = error;
+                    response.body = std::string(StatusMessage(error)) + "\n";
+                    response.head = std::string(StatusLine(error));
+                    response.head += "Content-Type: text/plain; charset=UTF-8\r\n";
+                    response.head += "Content-Length: " + std::to_string(response.body.size()) + "\r\n";
+                    response.head += "Server: SimpleHttpServer\r\n";
+                    rendered.push_back(std::move(response));
+                }
+                return rendered;
+            }();
+
+            for (auto& response : responses)
+                if (response.status == status)
+                    return &response;
+            return nullptr;
+        }
+
+        inline bool ContainsIgnoringCase(std::string_view text, std::string_view token)
+        {
+            for (std::size_t i = 0; i + token.size() <= text.size(); i++)
+                if (strncasecmp(text.data() + i, token.data(), token.size()) == 0)
+                    return true;
+            return false;
+        }
+
+        inline std::string_view TrimWhitespace(std::string_view text)
+        {
+            while (!text.empty() && (text.front() == ' ' || text.front() == '\t'))
+                text.remove_prefix(1);
+            while (!text.empty() && (text.back() == ' ' || text.back() == '\t'))
+                text.remove_suffix(1);
+            return text;
+        }
+
+#if defined(SIMPLE_HTTP_ZLIB)
+        enum class ContentEncoding
+        {
+            Identity,
+            Gzip,
+            Deflate
+        };
+
+        // Picks the coding for an Accept-Encoding value, gzip first. Codings
+        // with q=0 are refused, "*" stands for any coding not listed.
+        inline ContentEncoding NegotiateEncoding(std::string_view accept, bool gzip, bool deflate)
+        {
+            enum { Unlisted, Accepted, Refused } gzipState = Unlisted, deflateState = Unlisted, anyState = Unlisted;
+            while (!accept.empty())
+            {
+                std::size_t comma = accept.find(',');
+                std::string_view item = accept.substr(0, comma);
+                accept = comma == std::string_view::npos ? std::string_view() : accept.substr(comma + 1);
+
+                std::size_t semicolon = item.find(';');
+                std::string_view coding = TrimWhitespace(item.substr(0, semicolon));
+                bool refused = false;
+                if (semicolon != std::string_view::npos)
+                {
+                    std::string_view parameter = TrimWhitespace(item.substr(semicolon + 1));
+                    if (parameter.size() > 2 && (parameter[0] == 'q' || parameter[0] == 'Q') && parameter[1] == '=')
                     {
-                        state = HeaderLws;
+                        std::string_view quality = TrimWhitespace(parameter.substr(2));
+                        refused = quality.find_first_not_of("0.") == std::string_view::npos;
                     }
-                    else if( !IsChar(input) || IsControl(input) || IsSpecial(input) )
+                }
+
+                auto state = refused ? Refused : Accepted;
+                if (coding.size() == 4 && strncasecmp(coding.data(), "gzip", 4) == 0)
+                    gzipState = state;
+                else if (coding.size() == 6 && strncasecmp(coding.data(), "x-gzip", 6) == 0)
+                    gzipState = state;
+                else if (coding.size() == 7 && strncasecmp(coding.data(), "deflate", 7) == 0)
+                    deflateState = state;
+                else if (coding == "*")
+                    anyState = state;
+            }
+
+            if (gzip && (gzipState == Accepted || (gzipState == Unlisted && anyState == Accepted)))
+                return ContentEncoding::Gzip;
+            if (deflate && (deflateState == Accepted || (deflateState == Unlisted && anyState == Accepted)))
+                return ContentEncoding::Deflate;
+            return ContentEncoding::Identity;
+        }
+
+        // zlib deflate stream producing gzip or zlib (the deflate content
+        // coding) output. It is reset between responses instead of being
+        // allocated and freed for each one.
+        class Compressor
+        {
+        public:
+            Compressor(ContentEncoding encoding, int level) :
+                m_Level(level)
+            {
+                std::memset(&m_Stream, 0, sizeof(m_Stream));
+                int windowBits = encoding == ContentEncoding::Gzip ? 15 + 16 : 15;
+                if (deflateInit2(&m_Stream, level, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+                    throw std::runtime_error("deflateInit2 failed");
+            }
+
+            ~Compressor()
+            {
+                deflateEnd(&m_Stream);
+            }
+
+            Compressor(const Compressor&) = delete;
+            Compressor& operator=(const Compressor&) = delete;
+
+            // Replaces out with the whole compressed input.
+            bool Compress(std::string_view input, std::string& out)
+            {
+                out.clear();
+                Reset();
+                out.reserve(deflateBound(&m_Stream, static_cast<uLong>(input.size())));
+                return Run(input, Z_FINISH, out);
+            }
+
+            // Streaming use: Reset, Update with every piece of the body and
+            // Finish. Compressed output is appended to out, Update flushes
+            // so every piece can be sent as soon as it is compressed.
+            void Reset()
+            {
+                deflateReset(&m_Stream);
+            }
+
+            bool Update(std::string_view input, std::string& out)
+            {
+                return Run(input, Z_SYNC_FLUSH, out);
+            }
+
+            bool Finish(std::string& out)
+            {
+                return Run(std::string_view(), Z_FINISH, out);
+            }
+
+            // Takes effect on the next Reset.
+            void SetLevel(int level)
+            {
+                if (level == m_Level)
+                    return;
+                deflateParams(&m_Stream, level, Z_DEFAULT_STRATEGY);
+                m_Level = level;
+            }
+
+            // The compressor of the calling thread for encoding, created on
+            // first use.
+            static Compressor& ForThread(ContentEncoding encoding, int level)
+            {
+                static thread_local std::unique_ptr<Compressor> compressors[2];
+                auto& compressor = compressors[encoding == ContentEncoding::Gzip ? 0 : 1];
+                if (!compressor)
+                    compressor = std::make_unique<Compressor>(encoding, level);
+                compressor->Reset();
+                compressor->SetLevel(level);
+                return *compressor;
+            }
+
+        private:
+            bool Run(std::string_view input, int flush, std::string& out)
+            {
+                m_Stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+                m_Stream.avail_in = static_cast<uInt>(input.size());
+                for (;;)
+                {
+                    std::size_t used = out.size();
+                    out.resize(std::max<std::size_t>(out.capacity(), used + 4096));
+                    m_Stream.next_out = reinterpret_cast<Bytef*>(&out[used]);
+                    m_Stream.avail_out = static_cast<uInt>(out.size() - used);
+                    int result = deflate(&m_Stream, flush);
+                    out.resize(out.size() - m_Stream.avail_out);
+                    if (result == Z_STREAM_ERROR)
+                        return false;
+                    if (flush == Z_FINISH ? result == Z_STREAM_END : m_Stream.avail_out != 0)
+                        return true;
+                }
+            }
+
+        private:
+            z_stream m_Stream;
+            int m_Level;
+        };
+#endif
+
+        template<typename Stream> struct IsTlsStream : std::false_type {};
+#if defined(SIMPLE_HTTP_TLS)
+        template<typename Next> struct IsTlsStream<asio::ssl::stream<Next>> : std::true_type {};
+#endif
+
+        // What a Responder needs from a session, whatever its stream.
+        class Session
+        {
+        public:
+            virtual ~Session() = default;
+
+        protected:
+            virtual asio::any_io_executor Executor() = 0;
+            virtual void Respond(Response respond) = 0;
+            // Called on the session's thread. Closes the connection when it
+            // waits for a request or when force, otherwise ends it after
+            // the response in progress.
+            virtual void Drain(bool force) = 0;
+
+            friend class Simple::Responder;
+            friend class Simple::HttpServer;
+        };
+
+        // One connection over a TCP or Unix domain socket, or a TLS stream.
+        template<typename Stream>
+        class RequestSession final : public Session, public std::enable_shared_from_this<RequestSession<Stream>>
+        {
+            static constexpr bool Tls = IsTlsStream<Stream>::value;
+
+        public:
+            RequestSession(Stream socket, HttpServer* server, Shard* shard) :
+                m_Server(server), m_Shard(shard), m_Socket(std::move(socket)), m_Timer(m_Socket.get_executor()),
+                m_RequestBuffer(server->m_Limits.maxHeaderSize)
+            {
+                m_Phases[PhaseAccept] = std::chrono::steady_clock::now();
+                m_Server->m_Metrics.ConnectionOpened();
+                m_Shard->connections.fetch_add(1, std::memory_order_relaxed);
+#if defined(SIMPLE_HTTP_REGISTERED_BUFFERS)
+                // TLS streams read and write through their own buffers
+                if (!Tls && m_Shard->registeredBuffers)
+                    m_BufferSlot = m_Shard->registeredBuffers->Acquire();
+#endif
+            }
+            ~RequestSession()
+            {
+                m_Shard->RemoveSession(this);
+                // Releases the requests waiting for a response never given
+                if (m_CacheFill)
+                    m_Server->m_ResponseCache->Complete(m_CacheKey, nullptr, {}, {});
+                if (m_FlightLeader)
+                    m_Server->m_SingleFlight->Complete(m_CacheKey, nullptr);
+#if defined(SIMPLE_HTTP_REGISTERED_BUFFERS)
+                if (m_BufferSlot >= 0)
+                    m_Shard->registeredBuffers->Release(m_BufferSlot);
+#endif
+                m_Server->m_Metrics.ConnectionClosed();
+                if (m_Shard->connections.fetch_sub(1, std::memory_order_acq_rel) == 1 &&
+                    m_Server->m_Draining.load(std::memory_order_acquire))
+                    m_Server->SessionClosedWhileDraining();
+            }
+            void Start()
+            {
+                m_Shard->AddSession(this->shared_from_this());
+#if defined(SIMPLE_HTTP_TLS)
+                if constexpr (Tls)
+                {
+                    Handshake();
+                    return;
+                }
+#endif
+                ReadHeader();
+            }
+
+        private:
+            // Requests count as unmatched until routed
+            void BeginRequest()
+            {
+                m_Timer.cancel(); // The request is read
+                m_Phases[PhaseHandlerStart] = std::chrono::steady_clock::now();
+                m_RouteId = m_Server->m_Metrics.UnmatchedRoute();
+                m_Server->m_Metrics.RequestStarted();
+            }
+
+            // Routes m_Request, complete with its body
+            void Dispatch()
+            {
+                BeginRequest();
+
+                // HEAD falls back to the GET route, Respond drops the body
+                bool head = m_Request.methodType == Method::Head;
+                for (auto& router : m_Server->m_StaticRouters)
+                {
+                    int route = router.find(m_Request.method, m_Request.path);
+                    if (route < 0 && head)
+                        route = router.find(MethodName(Method::Get), m_Request.path);
+                    if (route < 0)
+                        continue;
+
+                    m_RouteId = router.firstId + route;
+                    Response respond;
+                    try
                     {
-                        return ParsingError;
+                        router.invoke(route, m_Request, respond);
+                    }
+                    catch (...)
+                    {
+                        RespondError(500);
+                        return;
                     }
+                    Respond(std::move(respond));
+                    return;
+                }
+
+                const Handler* handler = nullptr;
+                if (m_Request.methodType != Method::Unknown)
+                    handler = MatchRequest(m_Server->m_Handlers[static_cast<std::size_t>(m_Request.methodType)], m_Request);
+                if (!handler && head)
+                    handler = MatchRequest(m_Server->m_Handlers[static_cast<std::size_t>(Method::Get)], m_Request);
+
+                if (!handler)
+                {
+                    auto routes = m_Server->m_PathRoutes.find(m_Request.path);
+                    if (routes == m_Server->m_PathRoutes.end())
+                        RespondError(404);
+                    else if (m_Request.methodType == Method::Options)
+                        RespondOptions(routes->second);
                     else
+                        RespondError(405, routes->second.allow);
+                    return;
+                }
+                m_RouteId = handler->id;
+
+                if ((handler->options.cache.ttl.count() > 0 || handler->options.coalesce.enabled) && m_Server->m_SingleFlight &&
+                    (m_Request.methodType == Method::Get || head) && LookupCache(*handler))
+                    return;
+                RunHandler(*handler);
+            }
+
+            void RunHandler(const Handler& handler)
+            {
+                if (handler.options.offload && m_Server->m_OffloadPool)
+                {
+                    Offload(handler);
+                    return;
+                }
+
+                if (handler.deferredCallback)
+                {
+                    // A Responder unwound without Send answers 500
+                    try
                     {
-                        headers.push_back({});
-                        headers.back().first.reserve(16);
-                        headers.back().second.reserve(16);
-                        headers.back().first.push_back(input);
-                        state = HeaderName;
+                        handler.deferredCallback(m_Request, Responder(this->shared_from_this()));
                     }
-                    break;
-                case HeaderLws:
-                    if( input == '\r' )
+                    catch (...)
                     {
-                        state = ExpectingNewline_2;
                     }
-                    else if( input == ' ' || input == '\t' )
+                    return;
+                }
+
+                Response respond;
+                try
+                {
+                    handler.callback(m_Request, respond);
+                }
+                catch (...)
+                {
+                    RespondError(500);
+                    return;
+                }
+                Respond(std::move(respond));
+            }
+
+            // Answers from the response cache or waits for the request
+            // with the same key running the handler. False when this
+            // request runs it: Respond shares, and may store, its response.
+            bool LookupCache(const Handler& handler)
+            {
+                const RouteOptions& options = handler.options;
+                bool cached = options.cache.ttl.count() > 0;
+                const std::vector<std::string>& vary = cached ? options.cache.vary : options.coalesce.vary;
+                if (CarriesCredentials(vary))
+                    return false;
+                BuildCacheKey(vary);
+                if (cached)
+                {
+                    ResponseCache::Entry entry;
+                    auto result = m_Server->m_ResponseCache->Lookup(m_CacheKey, entry);
+                    if (result == ResponseCache::Hit)
                     {
+                        SendCached(std::move(entry));
+                        return true;
                     }
-                    else if( IsControl(input) )
+                    if (result == ResponseCache::Refresh)
                     {
-                        return ParsingError;
+                        m_CacheFill = &options.cache;
+                        return false;
                     }
-                    else
+                }
+
+                m_FlightLeader = m_Server->m_SingleFlight->Join(m_CacheKey,
+                    [this, &handler] () -> SingleFlight::Waiter
                     {
-                        state = HeaderValue;
-                        headers.back().second.push_back(input);
+                        return [this, self = this->shared_from_this(), &handler] (SingleFlight::Entry shared)
+                        {
+                            asio::post(m_Socket.get_executor(),
+                                [this, self, &handler, shared = std::move(shared)] () mutable
+                                {
+                                    // Without a response to share every waiter runs the handler
+                                    if (shared)
+                                        SendCached(std::move(shared));
+                                    else
+                                        RunHandler(handler);
+                                }
+                            );
+                        };
                     }
+                );
+                if (m_FlightLeader && cached)
+                    m_CacheFill = &options.cache;
+                return !m_FlightLeader;
+            }
+
+            // Responses to requests with credentials are their user's own,
+            // unless the key varies on the credentials.
+            bool CarriesCredentials(const std::vector<std::string>& vary) const
+            {
+                for (const char* name : { "Authorization", "Cookie" })
+                    if (FindHeader(m_Request.headers, name) && std::none_of(vary.begin(), vary.end(),
+                        [name] (const std::string& header) { return strcasecmp(header.c_str(), name) == 0; }))
+                        return true;
+                return false;
+            }
+
+            void BuildCacheKey(const std::vector<std::string>& varyHeaders)
+            {
+                auto vary = [this] (std::string_view name) {
+                    const std::string* value = FindHeader(m_Request.headers, name);
+                    m_CacheKey += '\n';
+                    if (value)
+                        m_CacheKey += *value;
+                };
+
+                m_CacheKey.assign(m_Request.method);
+                m_CacheKey += ' ';
+                m_CacheKey += m_Request.path;
+                for (auto& name : varyHeaders)
+                    vary(name);
+#if defined(SIMPLE_HTTP_ZLIB)
+                if (m_Server->m_Compression)
+                    vary("Accept-Encoding");
+#endif
+                if (m_Server->m_Cors)
+                    vary("Origin");
+            }
+
+            // Any response goes to the requests waiting for it, unless it
+            // sets cookies or its own Connection, or is meant for its
+            // requester only.
+            static bool IsShareable(const Response& respond)
+            {
+                if (FindHeader(respond.headers, "Set-Cookie") || FindHeader(respond.headers, "Connection"))
+                    return false;
+                const std::string* control = FindHeader(respond.headers, "Cache-Control");
+                return !control || (!ContainsIgnoringCase(*control, "private") && !ContainsIgnoringCase(*control, "no-store"));
+            }
+
+            // Statuses cacheable by default (RFC 9111), unless the handler
+            // asks to revalidate. Only asked of shareable responses.
+            static bool IsCacheable(const Response& respond)
+            {
+                switch (respond.status)
+                {
+                case 200: case 203: case 204: case 300: case 301: case 308:
+                case 404: case 405: case 410: case 414: case 501:
                     break;
-                case HeaderName:
-                    if( input == ':' )
+                default:
+                    return false;
+                }
+                const std::string* control = FindHeader(respond.headers, "Cache-Control");
+                return !control || !ContainsIgnoringCase(*control, "no-cache");
+            }
+
+            // Completes what LookupCache started with the response just
+            // serialized: stores it when cacheable and hands it to the
+            // requests waiting for it, e.g. a 503 from an overloaded
+            // backend that they would only ask for again.
+            void ShareResponse(bool shareable, bool cacheable)
+            {
+                ResponseCache::Entry entry;
+                if (shareable)
+                {
+                    static constexpr std::string_view connection = "\r\nConnection: ";
+                    auto cached = std::make_shared<CachedResponse>();
+                    cached->data.reserve(m_StatusLine.size() + m_ResponseData.size());
+                    cached->data.append(m_StatusLine).append(m_ResponseData);
+                    cached->connectionOffset = cached->data.find(connection) + connection.size();
+                    cached->connectionLength = cached->data.find("\r\n", cached->connectionOffset) - cached->connectionOffset;
+                    cached->headersEnd = cached->data.find("\r\n\r\n") + 2;
+                    cached->generated = std::chrono::steady_clock::now();
+                    cached->status = m_ResponseStatus;
+                    entry = std::move(cached);
+                }
+                if (m_CacheFill)
+                {
+                    const CacheOptions& options = *m_CacheFill;
+                    m_CacheFill = nullptr;
+                    m_Server->m_ResponseCache->Complete(m_CacheKey, cacheable ? entry : nullptr, options.ttl,
+                        options.staleWhileRevalidate);
+                }
+                if (m_FlightLeader)
+                {
+                    m_FlightLeader = false;
+                    m_Server->m_SingleFlight->Complete(m_CacheKey, std::move(entry));
+                }
+            }
+
+            // Writes a cached response as it is with one gather write. Only
+            // the value of its Connection header may be swapped, and its Age
+            // is added.
+            void SendCached(ResponseCache::Entry cached)
+            {
+                m_Phases[PhaseHandlerEnd] = std::chrono::steady_clock::now();
+                m_ResponseStatus = cached->status;
+                m_Cached = std::move(cached);
+
+                auto self(this->shared_from_this());
+                auto written = [this, self] (const asio::error_code& ec, size_t bytesTransfered)
+                {
+                    m_Cached.reset();
+                    Written(ec, bytesTransfered);
+                };
+                const std::string& data = m_Cached->data;
+                auto age = std::chrono::duration_cast<std::chrono::seconds>(
+                    std::chrono::steady_clock::now() - m_Cached->generated);
+                m_CachedAge.assign("Age: ").append(std::to_string(age.count())).append("\r\n");
+                auto rest = asio::buffer(data.data() + m_Cached->headersEnd, data.size() - m_Cached->headersEnd);
+
+                std::string_view connection = m_KeepAlive ? "keep-alive" : "close";
+                if (data.compare(m_Cached->connectionOffset, m_Cached->connectionLength, connection) == 0)
+                {
+                    std::array<asio::const_buffer, 3> buffers = {
+                        asio::buffer(data.data(), m_Cached->headersEnd),
+                        asio::buffer(m_CachedAge),
+                        rest
+                    };
+                    asio::async_write(m_Socket, buffers, std::move(written));
+                    return;
+                }
+                std::size_t end = m_Cached->connectionOffset + m_Cached->connectionLength;
+                std::array<asio::const_buffer, 5> buffers = {
+                    asio::buffer(data.data(), m_Cached->connectionOffset),
+                    asio::buffer(connection.data(), connection.size()),
+                    asio::buffer(data.data() + end, m_Cached->headersEnd - end),
+                    asio::buffer(m_CachedAge),
+                    rest
+                };
+                asio::async_write(m_Socket, buffers, std::move(written));
+            }
+
+            // Runs the handler on the offload pool and posts the response back
+            // to the executor of the session's socket. The io thread leaves
+            // m_Request alone until then.
+            void Offload(const Handler& handler)
+            {
+                auto self(this->shared_from_this());
+                bool queued = m_Server->m_OffloadPool->TrySubmit(
+                    [this, self, &handler] ()
                     {
-                        state = SpaceBeforeHeaderValue;
+                        if (handler.deferredCallback)
+                        {
+                            // A Responder unwound without Send answers 500
+                            try
+                            {
+                                handler.deferredCallback(m_Request, Responder(self));
+                            }
+                            catch (...)
+                            {
+                            }
+                            return;
+                        }
+
+                        Response respond;
+                        try
+                        {
+                            handler.callback(m_Request, respond);
+                        }
+                        catch (...)
+                        {
+                            respond = Response();
+                            respond.status = 500;
+                        }
+                        asio::post(m_Socket.get_executor(),
+                            [this, self, respond = std::move(respond)] () mutable
+                            {
+                                Respond(std::move(respond));
+                            }
+                        );
                     }
-                    else if( !IsChar(input) || IsControl(input) || IsSpecial(input) )
+                );
+
+                if (!queued)
+                {
+                    Response respond;
+                    respond.status = 503;
+                    respond.headers["Retry-After"] = "1";
+                    Respond(std::move(respond));
+                }
+            }
+
+            // Sends the cached OPTIONS answer, user code never runs. Only the
+            // allowed origin and the Date header are rendered per request.
+            void RespondOptions(const PathRoutes& routes)
+            {
+                m_Phases[PhaseHandlerEnd] = std::chrono::steady_clock::now();
+                m_RouteId = m_Server->m_OptionsRouteId;
+                m_ResponseStatus = 204;
+                m_ResponseData.clear();
+
+                const std::string* origin = FindHeader(m_Request.headers, "Origin");
+                if (!routes.preflight.empty() && origin && FindHeader(m_Request.headers, "Access-Control-Request-Method") &&
+                    m_Server->IsAllowedOrigin(*origin))
+                {
+                    m_StatusLine = routes.preflight;
+                    AllowOrigin(*origin, m_ResponseData);
+                }
+                else
+                    m_StatusLine = routes.options;
+
+                AppendConnectionAndDate(m_ResponseData);
+                Write();
+            }
+
+            // Answers with a built-in error, or through the server's error
+            // handler when one is set. An error handler that throws gets a
+            // plain 500 sent in its place.
+            void RespondError(uint16_t status, const std::string& allow = std::string())
+            {
+                const ErrorResponse* error = FindErrorResponse(status);
+                if (m_Server->m_ErrorHandler || !error)
+                {
+                    Response respond;
+                    respond.status = status;
+                    respond.body = std::string(StatusMessage(status)) + "\n";
+                    if (!allow.empty())
+                        respond.headers["Allow"] = allow;
+                    if (m_Server->m_ErrorHandler)
                     {
-                        return ParsingError;
+                        try
+                        {
+                            m_Server->m_ErrorHandler(m_Request, respond);
+                        }
+                        catch (...)
+                        {
+                            respond = Response();
+                            respond.status = 500;
+                            respond.body = std::string(StatusMessage(500)) + "\n";
+                        }
                     }
-                    else
+                    Respond(std::move(respond));
+                    return;
+                }
+
+                m_Phases[PhaseHandlerEnd] = std::chrono::steady_clock::now();
+                // A handler that threw leaves its waiters nothing to share
+                if (m_CacheFill || m_FlightLeader)
+                    ShareResponse(false, false);
+                m_ResponseStatus = status;
+                m_StatusLine = error->head;
+                m_ResponseData.clear();
+                if (!allow.empty())
+                    m_ResponseData += "Allow: " + allow + "\r\n";
+                AppendConnectionAndDate(m_ResponseData);
+                if (m_Request.methodType != Method::Head)
+                    m_ResponseData += error->body;
+                Write();
+            }
+
+#if defined(SIMPLE_HTTP_ZLIB)
+            // Replaces the body with its compressed form when the client
+            // accepts it and it is worth it.
+            void Compress(Response& respond)
+            {
+                auto& options = *m_Server->m_Compression;
+                if (respond.body.size() < options.minSize || respond.status == 204 || respond.status == 304 ||
+                    respond.headers.count("Content-Encoding"))
+                    return;
+                const std::string& type = respond.headers["Content-Type"];
+                for (auto& skipped : options.skipContentTypes)
+                    if (type.compare(0, skipped.size(), skipped) == 0)
+                        return;
+
+                // The body depends on Accept-Encoding from here on
+                auto& vary = respond.headers["Vary"];
+                vary += vary.empty() ? "Accept-Encoding" : ", Accept-Encoding";
+
+                const std::string* accept = FindHeader(m_Request.headers, "Accept-Encoding");
+                if (!accept)
+                    return;
+                ContentEncoding encoding = NegotiateEncoding(*accept, options.gzip, options.deflate);
+                if (encoding == ContentEncoding::Identity)
+                    return;
+
+                std::string compressed;
+                if (!Compressor::ForThread(encoding, options.level).Compress(respond.body, compressed) ||
+                    compressed.size() >= respond.body.size())
+                    return;
+                respond.body = std::move(compressed);
+                respond.headers["Content-Encoding"] = encoding == ContentEncoding::Gzip ? "gzip" : "deflate";
+            }
+#endif
+
+            // Ends the header block of the pre-rendered responses.
+            void AppendConnectionAndDate(std::string& out)
+            {
+                char date[32];
+                out += m_KeepAlive ? "Connection: keep-alive\r\nDate: " : "Connection: close\r\nDate: ";
+                out += HttpDate(date);
+                out += "\r\n\r\n";
+            }
+
+            void AllowOrigin(const std::string& origin, std::string& out)
+            {
+                auto& cors = *m_Server->m_Cors;
+                bool any = std::find(cors.allowOrigins.begin(), cors.allowOrigins.end(), "*") != cors.allowOrigins.end();
+                if (any && !cors.allowCredentials)
+                    out += "Access-Control-Allow-Origin: *\r\n";
+                else
+                {
+                    out += "Access-Control-Allow-Origin: " + origin + "\r\n";
+                    out += "Vary: Origin\r\n";
+                }
+            }
+
+            asio::any_io_executor Executor() override
+            {
+                return m_Socket.get_executor();
+            }
+
+            void Drain(bool force) override
+            {
+                if (force || m_Idle)
+                    Close();
+                else
+                    m_KeepAlive = false;
+            }
+
+            void Respond(Response respond) override
+            {
+                m_Phases[PhaseHandlerEnd] = std::chrono::steady_clock::now();
+                m_ResponseStatus = respond.status;
+                m_StatusLine = StatusLine(respond.status);
+                m_ResponseData.clear();
+                if (m_Server->m_Cors && !respond.headers.count("Access-Control-Allow-Origin"))
+                {
+                    const std::string* origin = FindHeader(m_Request.headers, "Origin");
+                    if (origin && m_Server->IsAllowedOrigin(*origin))
                     {
-                        headers.back().first.push_back(input);
+                        AllowOrigin(*origin, m_ResponseData);
+                        if (m_Server->m_Cors->allowCredentials)
+                            m_ResponseData += "Access-Control-Allow-Credentials: true\r\n";
                     }
-                    break;
-                case SpaceBeforeHeaderValue:
-                    if( input == ' ' )
+                }
+#if defined(SIMPLE_HTTP_ZLIB)
+                if (m_Server->m_Compression)
+                    Compress(respond);
+#endif
+                auto connection = respond.headers.find("Connection");
+                if (connection != respond.headers.end() && strcasecmp(connection->second.c_str(), "close") == 0)
+                    m_KeepAlive = false;
+                bool sharing = m_CacheFill || m_FlightLeader;
+                bool shareable = sharing && IsShareable(respond);
+                bool cacheable = shareable && m_CacheFill && IsCacheable(respond);
+                // HEAD answers carry the Content-Length of the body they omit
+                SerializeHeaders(respond, m_ResponseData, m_Request.methodType != Method::Head, m_KeepAlive);
+                if (sharing)
+                    ShareResponse(shareable, cacheable);
+                Write();
+            }
+
+            void Write()
+            {
+                auto self(this->shared_from_this());
+#if defined(SIMPLE_HTTP_REGISTERED_BUFFERS)
+                // Responses that fit are copied into the registered buffer
+                // and sent with a single write_fixed
+                std::size_t size = m_StatusLine.size() + m_ResponseData.size();
+                if constexpr (!Tls) if (m_BufferSlot >= 0 && size <= m_Shard->registeredBuffers->BufferSize())
+                {
+                    auto buffer = m_Shard->registeredBuffers->Buffer(m_BufferSlot);
+                    char* out = static_cast<char*>(buffer.data());
+                    std::memcpy(out, m_StatusLine.data(), m_StatusLine.size());
+                    std::memcpy(out + m_StatusLine.size(), m_ResponseData.data(), m_ResponseData.size());
+                    asio::async_write(m_Socket, asio::buffer(buffer, size),
+                        [this, self] (const asio::error_code& ec, size_t bytesTransfered)
+                        {
+                            Written(ec, bytesTransfered);
+                        }
+                    );
+                    return;
+                }
+#endif
+                std::array<asio::const_buffer, 2> buffers = {
+                    asio::buffer(m_StatusLine.data(), m_StatusLine.size()),
+                    asio::buffer(m_ResponseData)
+                };
+                asio::async_write(m_Socket, buffers, 
+                    [this, self] (const asio::error_code& ec, size_t bytesTransfered)
                     {
-                        state = HeaderValue;
+                        Written(ec, bytesTransfered);
                     }
+                );
+            }
+
+            void Written(const asio::error_code& ec, size_t bytesTransfered)
+            {
+                m_Phases[PhaseWriteComplete] = std::chrono::steady_clock::now();
+                m_Server->m_Metrics.RequestFinished(m_RouteId, m_ResponseStatus,
+                    m_Phases[PhaseWriteComplete] - m_Phases[PhaseHandlerStart]);
+                if(!ec)
+                {
+                    m_Server->m_PhaseHistograms.Record(m_Phases);
+                    if (m_Server->m_AccessLog)
+                        LogAccess(bytesTransfered);
+                    if (m_KeepAlive)
+                        NextRequest();
                     else
+                        Shutdown();
+                }
+                else
+                {
+                    Close();
+                }
+            }
+
+            void LogAccess(size_t bytesSent)
+            {
+                Details::AccessLogRecord* record = m_Server->m_AccessLog->Reserve();
+                if (!record)
+                    return;
+
+                auto copy = [] (char* destination, size_t size, const std::string& value) {
+                    size_t length = std::min(value.size(), size - 1);
+                    std::memcpy(destination, value.data(), length);
+                    destination[length] = '\0';
+                };
+                auto header = [this] (const char* name) -> const std::string& {
+                    static const std::string empty;
+                    auto it = m_Request.headers.find(name);
+                    return it != m_Request.headers.end() ? it->second : empty;
+                };
+
+                record->time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::system_clock::now().time_since_epoch()).count();
+                record->durationNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    m_Phases[PhaseWriteComplete] - m_Phases[PhaseFirstByte]).count();
+                record->bytesSent = bytesSent;
+                record->status = m_ResponseStatus;
+                record->versionMajor = static_cast<uint8_t>(m_Request.versionMajor);
+                record->versionMinor = static_cast<uint8_t>(m_Request.versionMinor);
+                record->addressFamily = 0; // Unix domain sockets have no address to log
+                if constexpr (std::is_same_v<typename Stream::lowest_layer_type::protocol_type, asio::ip::tcp>)
+                {
+                    asio::error_code ec;
+                    auto endpoint = m_Socket.lowest_layer().remote_endpoint(ec);
+                    if (!ec && endpoint.address().is_v4())
                     {
-                        return ParsingError;
+                        auto bytes = endpoint.address().to_v4().to_bytes();
+                        std::memcpy(record->address, bytes.data(), bytes.size());
+                        record->addressFamily = 4;
                     }
-                    break;
-                case HeaderValue:
-                    if( input == '\r' )
+                    else if (!ec)
                     {
-                        if( req.method == "POST" || req.method == "PUT" )
-                        {
-                            auto &h = headers.back();
+                        auto bytes = endpoint.address().to_v6().to_bytes();
+                        std::memcpy(record->address, bytes.data(), bytes.size());
+                        record->addressFamily = 6;
+                    }
+                }
+                copy(record->method, sizeof(record->method), m_Request.method);
+                copy(record->path, sizeof(record->path), m_Request.path);
+                copy(record->referer, sizeof(record->referer), header("Referer"));
+                copy(record->userAgent, sizeof(record->userAgent), header("User-Agent"));
+                m_Server->m_AccessLog->Commit();
+            }
 
-                            if( strcasecmp(h.first.c_str(), "Content-Length") == 0 )
-                            {
-                                contentSize = atoi(h.second.c_str());
-                                req.body.reserve( contentSize );
-                                req.contentLength = contentSize;
-                            }
-                            else if( strcasecmp(h.first.c_str(), "Transfer-Encoding") == 0 )
-                            {
-                                if(strcasecmp(h.second.c_str(), "chunked") == 0)
-                                    chunked = true;
-                            }
+            // Resets the per request state and waits for the next request
+            // on a kept-alive connection. Its accept phase starts now.
+            void NextRequest()
+            {
+                m_Request = Request();
+                m_Phases = PhaseTimestamps();
+                m_Phases[PhaseAccept] = std::chrono::steady_clock::now();
+                m_RouteId = 0;
+                m_ResponseStatus = 0;
+                m_KeepAlive = false;
+                ReadHeader();
+            }
+
+            void Shutdown()
+            {
+                asio::error_code ignored;
+                m_Timer.cancel();
+#if defined(SIMPLE_HTTP_TLS)
+                if constexpr (Tls)
+                {
+                    // Sends close_notify, the peer gets handshakeTimeout to answer
+                    auto self(this->shared_from_this());
+                    m_Timer.expires_after(m_Server->m_Limits.handshakeTimeout);
+                    m_Timer.async_wait(
+                        [this, self] (const asio::error_code& ec)
+                        {
+                            if (!ec)
+                                Close();
                         }
-                        state = ExpectingNewline_2;
+                    );
+                    m_Socket.async_shutdown(
+                        [this, self] (const asio::error_code& ec)
+                        {
+                            Close();
+                        }
+                    );
+                    return;
+                }
+#endif
+                m_Socket.lowest_layer().shutdown(asio::socket_base::shutdown_both, ignored);
+            }
+
+            void Close()
+            {
+                asio::error_code ignored;
+                m_Timer.cancel();
+#if defined(SIMPLE_HTTP_TLS)
+                // OpenSSL evicts the sessions of connections freed without a
+                // shutdown, most clients just close after their last response
+                if constexpr (Tls)
+                {
+                    SSL_set_quiet_shutdown(m_Socket.native_handle(), 1);
+                    SSL_shutdown(m_Socket.native_handle());
+                }
+#endif
+                m_Socket.lowest_layer().close(ignored);
+            }
+
+#if defined(SIMPLE_HTTP_TLS)
+            void Handshake()
+            {
+                auto self(this->shared_from_this());
+                m_Timer.expires_after(m_Server->m_Limits.handshakeTimeout);
+                m_Timer.async_wait(
+                    [this, self] (const asio::error_code& ec)
+                    {
+                        if (!ec)
+                            Close();
                     }
-                    else if( IsControl(input) )
+                );
+                m_Socket.async_handshake(asio::ssl::stream_base::server,
+                    [this, self] (const asio::error_code& ec)
                     {
-                        return ParsingError;
+                        m_Timer.cancel();
+                        if (ec)
+                        {
+                            Close();
+                            return;
+                        }
+
+                        ReadHeader();
                     }
-                    else
+                );
+            }
+#endif
+
+            // Closes the connection unless the timer is canceled or armed
+            // again first.
+            void CloseAfter(std::chrono::milliseconds timeout)
+            {
+                auto self(this->shared_from_this());
+                m_Timer.expires_after(timeout);
+                m_Timer.async_wait(
+                    [this, self] (const asio::error_code& ec)
                     {
-                        headers.back().second.push_back(input);
+                        if (!ec)
+                            Close();
                     }
-                    break;
-                case ExpectingNewline_2:
-                    if( input == '\n' )
+                );
+            }
+
+            bool WantsKeepAlive() const
+            {
+                auto& limits = m_Server->m_Limits;
+                if (limits.keepAliveTimeout.count() <= 0 || m_RequestCount >= limits.maxKeepAliveRequests ||
+                    m_Server->m_Draining.load(std::memory_order_relaxed))
+                    return false;
+
+                const std::string* connection = FindHeader(m_Request.headers, "Connection");
+                if (m_Request.versionMajor > 1 || (m_Request.versionMajor == 1 && m_Request.versionMinor >= 1))
+                    return !connection || strcasecmp(connection->c_str(), "close") != 0;
+                return connection && strcasecmp(connection->c_str(), "keep-alive") == 0;
+            }
+
+            void ReadBody()
+            {
+                auto self(this->shared_from_this());
+                if (m_Request.body.size() >= m_Request.contentLength)
+                {
+                    Dispatch();
+                    return;
+                }
+
+                bodyBuffer.clear(); 
+                bodyBuffer.resize(std::min<size_t>(m_Request.contentLength - m_Request.body.size(), 64 * 1024));
+                m_Socket.async_read_some(asio::buffer(bodyBuffer, bodyBuffer.size()),
+                    [this, self] (const asio::error_code& ec, size_t bytesTransfered)
                     {
-                        state = HeaderLineStart;
+                        if (ec)
+                        {
+                            Close();
+                            return;
+                        }
+
+                        m_Request.body.append(reinterpret_cast<char const*>(bodyBuffer.data()), bytesTransfered);
+                        ReadBody();
                     }
-                    else
+                );
+            }
+
+            void ReadHeader()
+            {
+                // Pipelined requests may be buffered already
+                if (m_RequestBuffer.size() > 0)
+                {
+                    m_Phases[PhaseFirstByte] = std::chrono::steady_clock::now();
+                    CloseAfter(m_Server->m_Limits.requestTimeout);
+                    ReadRemainingHeader();
+                    return;
+                }
+
+                auto self(this->shared_from_this());
+                m_Idle = true;
+                CloseAfter(m_RequestCount > 0 ? m_Server->m_Limits.keepAliveTimeout : m_Server->m_Limits.requestTimeout);
+
+                // The first read is issued by hand to timestamp the first byte
+#if defined(SIMPLE_HTTP_REGISTERED_BUFFERS)
+                if constexpr (!Tls) if (m_BufferSlot >= 0)
+                {
+                    // read_fixed into the registered buffer, copied into the request buffer
+                    auto buffer = asio::buffer(m_Shard->registeredBuffers->Buffer(m_BufferSlot), m_RequestBuffer.max_size());
+                    m_Socket.async_read_some(buffer,
+                        [this, self, buffer] (const asio::error_code& ec, size_t bytesTransfered)
+                        {
+                            if (!ec)
+                                asio::buffer_copy(m_RequestBuffer.prepare(bytesTransfered), buffer.buffer(), bytesTransfered);
+                            FirstBytesRead(ec, bytesTransfered);
+                        }
+                    );
+                    return;
+                }
+#endif
+                m_Socket.async_read_some(m_RequestBuffer.prepare(std::min<std::size_t>(4096, m_RequestBuffer.max_size())),
+                    [this, self] (const asio::error_code& ec, size_t bytesTransfered)
                     {
-                        return ParsingError;
+                        FirstBytesRead(ec, bytesTransfered);
                     }
-                    break;
-                case ExpectingNewline_3: {
-                    std::vector<std::pair<std::string, std::string>>::iterator it = std::find_if(headers.begin(),
-                                                                        headers.end(),
-                                                                        CheckIfConnection);
+                );
+            }
 
-                    if( it != headers.end() )
+            // bytesTransfered were written to m_RequestBuffer.prepare()
+            void FirstBytesRead(const asio::error_code& ec, size_t bytesTransfered)
+            {
+                m_Idle = false;
+                if (ec)
+                {
+                    Close();
+                    return;
+                }
+                // The first request's timer runs on from the accept
+                if (m_RequestCount > 0)
+                    CloseAfter(m_Server->m_Limits.requestTimeout);
+
+                m_Phases[PhaseFirstByte] = std::chrono::steady_clock::now();
+                m_RequestBuffer.commit(bytesTransfered);
+                ReadRemainingHeader();
+            }
+
+            void ReadRemainingHeader()
+            {
+                auto self(this->shared_from_this());
+                asio::async_read_until(m_Socket, m_RequestBuffer, Details::END_TOKEN,
+                    [this, self] (const asio::error_code& ec, size_t headerSize)
                     {
-                        if( strcasecmp(it->second.c_str(), "Keep-Alive") == 0 )
+                        if (ec == asio::error::not_found)
                         {
-                            // req.keepAlive = true;
+                            // The headers outgrew maxHeaderSize
+                            auto data = m_RequestBuffer.data();
+                            std::string buffered(asio::buffers_begin(data), asio::buffers_end(data));
+                            BeginRequest();
+                            RespondError(buffered.find("\r\n") == std::string::npos ? 414 : 431);
+                            return;
                         }
-                        else  // == Close
+                        if (ec)
                         {
-                            // req.keepAlive = false;
+                            Close();
+                            return;
                         }
-                    }
-                    else
-                    {
-                        // if( req.versionMajor > 1 || (req.versionMajor == 1 && req.versionMinor == 1) )
-                        //     req.keepAlive = true;
-                    }
 
-                    if( chunked )
-                    {
+                        auto data = m_RequestBuffer.data();
+                        std::string header(asio::buffers_begin(data), asio::buffers_begin(data) + headerSize);
+                        m_RequestBuffer.consume(headerSize);
+                        m_RequestCount++;
+
+                        ParseResult parsed = ParseRequest(header, m_Request, ParseHeadersOnly);
+                        m_Phases[PhaseHeadersParsed] = std::chrono::steady_clock::now();
+                        if (parsed != ParsingCompleted)
+                        {
+                            // Where a malformed request ends is only known when it has no body
+                            m_KeepAlive = !ContainsIgnoringCase(header, "Content-Length") &&
+                                !ContainsIgnoringCase(header, "Transfer-Encoding") && m_RequestCount < m_Server->m_Limits.maxKeepAliveRequests &&
+                                m_Server->m_Limits.keepAliveTimeout.count() > 0;
+                            BeginRequest();
+                            RespondError(400);
+                            return;
+                        }
+
+                        m_KeepAlive = WantsKeepAlive();
+                        uint16_t error = 0;
+                        if (FindHeader(m_Request.headers, "Transfer-Encoding"))
+                            error = 501; // Chunked request bodies are not supported
+                        else if (m_Request.contentLength > m_Server->m_Limits.maxBodySize)
+                            error = 413;
+                        else if (m_Request.path.size() > m_Server->m_Limits.maxUriLength)
+                            error = 414;
+                        if (error)
+                        {
+                            // The body is left unread
+                            m_KeepAlive = m_KeepAlive && m_Request.contentLength == 0 && error != 501;
+                            BeginRequest();
+                            RespondError(error);
+                            return;
+                        }
+
+                        // Body bytes that arrived with the headers
+                        std::size_t buffered = std::min<std::size_t>(m_Request.contentLength, m_RequestBuffer.size());
+                        data = m_RequestBuffer.data();
+                        m_Request.body.assign(asio::buffers_begin(data), asio::buffers_begin(data) + buffered);
+                        m_RequestBuffer.consume(buffered);
+
+                        ReadBody();
                     }
-                    else if( contentSize == 0 )
+                );
+            }
+
+        private:
+            HttpServer* m_Server;
+            Shard* m_Shard;
+            Stream m_Socket;
+            asio::steady_timer m_Timer; // Handshake, request read and keep-alive idle timeouts
+            asio::streambuf m_RequestBuffer; // Bounded by maxHeaderSize
+            std::vector<uint8_t> bodyBuffer;
+            std::string_view m_StatusLine;
+            std::string m_ResponseData;
+            Request m_Request; // Kept alive until the response is written
+            PhaseTimestamps m_Phases;
+            std::size_t m_RouteId = 0;
+            uint16_t m_ResponseStatus = 0;
+            bool m_KeepAlive = false;
+            bool m_Idle = true; // Waiting for the handshake or the first byte of a request
+            std::string m_CacheKey;
+            const CacheOptions* m_CacheFill = nullptr; // Set while this request fills the response cache
+            bool m_FlightLeader = false; // Set while others wait for this request's response
+            ResponseCache::Entry m_Cached; // Response being written from the cache
+            std::string m_CachedAge;       // Its Age header
+            std::size_t m_RequestCount = 0; // Requests read on this connection
+#if defined(SIMPLE_HTTP_REGISTERED_BUFFERS)
+            int m_BufferSlot = -1; // Registered buffer held while the connection is open
+#endif
+
+            friend class Simple::Responder;
+        };
+
+        // Accepts connections for the server, started by Start.
+        class Listener
+        {
+        public:
+            virtual ~Listener() = default;
+            virtual void Accept() = 0;
+            // Stops accepting, the connections already accepted go on.
+            virtual void Close() = 0;
+#if defined(SIMPLE_HTTP_LISTENER_HANDOFF)
+            // Listening socket, for another process to take over. The
+            // listener then leaves the socket file of a Unix domain socket
+            // in place.
+            virtual int HandOff() = 0;
+#endif
+        };
+
+        // Applied between bind and listen.
+        template<typename Acceptor>
+        void ApplyListenOptions(Acceptor& acceptor, const ListenOptions& options)
+        {
+            if (options.socket.receiveBuffer > 0)
+                acceptor.set_option(asio::socket_base::receive_buffer_size(options.socket.receiveBuffer));
+            if (options.socket.sendBuffer > 0)
+                acceptor.set_option(asio::socket_base::send_buffer_size(options.socket.sendBuffer));
+            if constexpr (std::is_same_v<typename Acceptor::protocol_type, asio::ip::tcp>)
+            {
+#if defined(TCP_DEFER_ACCEPT)
+                if (options.deferAccept.count() > 0)
+                    acceptor.set_option(asio::detail::socket_option::integer<IPPROTO_TCP, TCP_DEFER_ACCEPT>(
+                        static_cast<int>(options.deferAccept.count())));
+#endif
+#if defined(TCP_FASTOPEN)
+                if (options.fastOpenQueue > 0)
+                    acceptor.set_option(asio::detail::socket_option::integer<IPPROTO_TCP, TCP_FASTOPEN>(options.fastOpenQueue));
+#endif
+            }
+        }
+
+        // Applied to every accepted socket, failures are ignored.
+        template<typename Socket>
+        void ApplySocketOptions(Socket& socket, const SocketOptions& options)
+        {
+            if constexpr (std::is_same_v<typename Socket::protocol_type, asio::ip::tcp>)
+            {
+                asio::error_code ignored;
+                if (options.noDelay)
+                    socket.set_option(asio::ip::tcp::no_delay(true), ignored);
+#if defined(TCP_QUICKACK)
+                if (options.quickAck)
+                    socket.set_option(asio::detail::socket_option::integer<IPPROTO_TCP, TCP_QUICKACK>(1), ignored);
+#endif
+#if defined(SO_BUSY_POLL)
+                if (options.busyPoll.count() > 0)
+                    socket.set_option(asio::detail::socket_option::integer<SOL_SOCKET, SO_BUSY_POLL>(
+                        static_cast<int>(options.busyPoll.count())), ignored);
+#endif
+            }
+        }
+
+        template<typename Protocol>
+        typename Protocol::acceptor OpenAcceptor(asio::io_context& context, const typename Protocol::endpoint& endpoint,
+            const ListenOptions& options)
+        {
+            typename Protocol::acceptor acceptor(context);
+            acceptor.open(endpoint.protocol());
+            if constexpr (std::is_same_v<Protocol, asio::ip::tcp>)
+            {
+                acceptor.set_option(asio::socket_base::reuse_address(true));
+                // "::" also accepts IPv4 unless v6Only
+                if (endpoint.address().is_v6())
+                    acceptor.set_option(asio::ip::v6_only(options.v6Only));
+            }
+            acceptor.bind(endpoint);
+            ApplyListenOptions(acceptor, options);
+            acceptor.listen(options.backlog);
+            return acceptor;
+        }
+
+#if defined(SIMPLE_HTTP_LISTENER_HANDOFF)
+        // Takes over a bound socket, usually listening already in the
+        // process that handed it off. listen again only sets the backlog.
+        template<typename Protocol>
+        typename Protocol::acceptor AdoptAcceptor(asio::io_context& context, const Protocol& protocol, int fd,
+            const ListenOptions& options)
+        {
+            typename Protocol::acceptor acceptor(context, protocol, fd);
+            ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+            ApplyListenOptions(acceptor, options);
+            acceptor.listen(options.backlog);
+            return acceptor;
+        }
+
+        inline int SocketFamily(int fd)
+        {
+            sockaddr_storage address{};
+            socklen_t length = sizeof(address);
+            if (::getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length) != 0)
+                throw std::system_error(errno, std::generic_category(), "getsockname");
+            return address.ss_family;
+        }
+
+        // Sends fds over a connected Unix domain socket, with SCM_RIGHTS.
+        inline void SendFds(int socket, const std::vector<int>& fds)
+        {
+            uint32_t count = static_cast<uint32_t>(fds.size());
+            iovec data{&count, sizeof(count)};
+            std::vector<char> control(CMSG_SPACE(sizeof(int) * std::max<std::size_t>(1, fds.size())));
+            msghdr message{};
+            message.msg_iov = &data;
+            message.msg_iovlen = 1;
+            if (!fds.empty())
+            {
+                message.msg_control = control.data();
+                message.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+                cmsghdr* header = CMSG_FIRSTHDR(&message);
+                header->cmsg_level = SOL_SOCKET;
+                header->cmsg_type = SCM_RIGHTS;
+                header->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+                std::memcpy(CMSG_DATA(header), fds.data(), sizeof(int) * fds.size());
+            }
+            if (::sendmsg(socket, &message, MSG_NOSIGNAL) < 0)
+                throw std::system_error(errno, std::generic_category(), "sendmsg");
+        }
+
+        // Whether the process at the other end of a Unix domain socket
+        // runs as the effective user of this one.
+        inline bool PeerIsSameUser(int socket)
+        {
+#if defined(SO_PEERCRED)
+            ucred credentials{};
+            socklen_t length = sizeof(credentials);
+            if (::getsockopt(socket, SOL_SOCKET, SO_PEERCRED, &credentials, &length) != 0)
+                return false;
+            return credentials.uid == ::geteuid();
+#else
+            uid_t user;
+            gid_t group;
+            if (::getpeereid(socket, &user, &group) != 0)
+                return false;
+            return user == ::geteuid();
+#endif
+        }
+
+        inline std::vector<int> ReceiveFds(int socket)
+        {
+            uint32_t count = 0;
+            iovec data{&count, sizeof(count)};
+            std::vector<char> control(CMSG_SPACE(sizeof(int) * 253)); // SCM_MAX_FD
+            msghdr message{};
+            message.msg_iov = &data;
+            message.msg_iovlen = 1;
+            message.msg_control = control.data();
+            message.msg_controllen = control.size();
+            if (::recvmsg(socket, &message, MSG_CMSG_CLOEXEC) < 0)
+                throw std::system_error(errno, std::generic_category(), "recvmsg");
+
+            std::vector<int> fds;
+            for (cmsghdr* header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header))
+                if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+                {
+                    std::size_t received = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                    fds.resize(received);
+                    std::memcpy(fds.data(), CMSG_DATA(header), sizeof(int) * received);
+                }
+            // The kernel closed the descriptors that did not fit
+            if ((message.msg_flags & MSG_CTRUNC) || fds.size() != count)
+            {
+                for (int fd : fds)
+                    ::close(fd);
+                throw std::runtime_error("Listening sockets were lost in the hand off");
+            }
+            return fds;
+        }
+#endif
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+        // A socket file left by a previous run would fail the bind
+        inline asio::local::stream_protocol::endpoint RemoveStaleSocket(const std::string& path)
+        {
+            std::error_code ignored;
+            if (std::filesystem::is_socket(path, ignored))
+                std::filesystem::remove(path, ignored);
+            return asio::local::stream_protocol::endpoint(path);
+        }
+#endif
+
+        // Accepts connections on an acceptor of Protocol and serves them
+        // over Protocol's socket.
+        template<typename Protocol>
+        class SocketListener : public Listener
+        {
+        public:
+            SocketListener(HttpServer* server, typename Protocol::acceptor acceptor, const ListenOptions& options) :
+                m_Server(server), m_Acceptor(std::move(acceptor)), m_Options(options.socket),
+                m_Batch(std::max<std::size_t>(1, options.acceptBatch)), m_RetryTimer(m_Acceptor.get_executor())
+            {
+                m_Acceptor.non_blocking(true);
+            }
+
+            // Waits for the listen queue to be readable, then drains up to
+            // m_Batch connections with non-blocking accepts, each straight
+            // into the context of its shard.
+            void Accept() override
+            {
+                m_Acceptor.async_wait(asio::socket_base::wait_read,
+                    [this] (const asio::error_code& ec)
                     {
-                        if( input == '\n')
+                        if (!m_Acceptor.is_open())
+                            return;
+
+                        asio::error_code error = ec;
+                        for (std::size_t accepted = 0; !error && accepted < m_Batch; accepted++)
                         {
-                            for (auto& [name, value] : headers)
-                                req.headers[name] = std::move(value);
-                            for (auto& [name, value] : params)
-                                req.params[name] = std::move(value);
-                            return ParsingCompleted;
+                            Shard& shard = m_Server->NextShard();
+                            typename Protocol::socket socket = m_Acceptor.accept(*shard.context, error);
+                            if (error == asio::error::connection_aborted)
+                            {
+                                error.clear(); // Reset by the client while queued
+                                continue;
+                            }
+                            if (error)
+                                break; // would_block once the queue is empty
+
+                            m_Server->AdvanceShard();
+                            ApplySocketOptions(socket, m_Options);
+                            Accepted(std::move(socket), shard);
                         }
-                        else
-                            return ParsingError;
+
+                        // Out of descriptors or memory the queue stays
+                        // readable, waiting on it again would spin
+                        if (error && error != asio::error::would_block && error != asio::error::try_again)
+                        {
+                            m_RetryTimer.expires_after(AcceptRetryDelay);
+                            m_RetryTimer.async_wait(
+                                [this] (const asio::error_code& ec)
+                                {
+                                    if (!ec && m_Acceptor.is_open())
+                                        Accept();
+                                }
+                            );
+                            return;
+                        }
+                        Accept();
                     }
-                    else
+                );
+            }
+
+            void Close() override
+            {
+                asio::error_code ignored;
+                m_Acceptor.close(ignored);
+                m_RetryTimer.cancel();
+            }
+
+#if defined(SIMPLE_HTTP_LISTENER_HANDOFF)
+            int HandOff() override
+            {
+                return m_Acceptor.native_handle();
+            }
+#endif
+
+        protected:
+            virtual void Accepted(typename Protocol::socket socket, Shard& shard)
+            {
+                Start(std::make_shared<RequestSession<typename Protocol::socket>>(std::move(socket), m_Server, &shard), shard);
+            }
+
+            // Sessions only run on their shard's thread
+            template<typename Session>
+            static void Start(std::shared_ptr<Session> session, Shard& shard)
+            {
+                asio::dispatch(shard.context->get_executor(), [session = std::move(session)] () { session->Start(); });
+            }
+
+        protected:
+            static constexpr std::chrono::milliseconds AcceptRetryDelay{100};
+
+            HttpServer* m_Server;
+            typename Protocol::acceptor m_Acceptor;
+            SocketOptions m_Options;
+            std::size_t m_Batch;
+            asio::steady_timer m_RetryTimer; // Delays accepting after an error other than would_block
+        };
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+        class UnixListener final : public SocketListener<asio::local::stream_protocol>
+        {
+        public:
+            UnixListener(HttpServer* server, asio::io_context& context, const std::string& path, const ListenOptions& options) :
+                SocketListener(server, OpenAcceptor<asio::local::stream_protocol>(context, RemoveStaleSocket(path), options),
+                    options), m_Path(path)
+            {
+            }
+            ~UnixListener()
+            {
+                std::error_code ignored;
+                if (!m_Path.empty())
+                    std::filesystem::remove(m_Path, ignored);
+            }
+
+#if defined(SIMPLE_HTTP_LISTENER_HANDOFF)
+            // The process taking over serves the same file
+            int HandOff() override
+            {
+                m_Path.clear();
+                return SocketListener::HandOff();
+            }
+#endif
+
+        private:
+            std::string m_Path;
+        };
+#endif
+
+#if defined(SIMPLE_HTTP_TLS)
+        class TlsListener final : public SocketListener<asio::ip::tcp>
+        {
+        public:
+            TlsListener(HttpServer* server, asio::ip::tcp::acceptor acceptor, const TlsOptions& tls, const ListenOptions& options) :
+                SocketListener(server, std::move(acceptor), options), m_Context(asio::ssl::context::tls_server)
+            {
+                m_Context.set_options(asio::ssl::context::default_workarounds | asio::ssl::context::no_sslv2 |
+                    asio::ssl::context::no_sslv3 | asio::ssl::context::no_tlsv1 | asio::ssl::context::no_tlsv1_1);
+                m_Context.use_certificate_chain_file(tls.certificateChainFile);
+                m_Context.use_private_key_file(tls.privateKeyFile, asio::ssl::context::pem);
+
+                SSL_CTX* native = m_Context.native_handle();
+                static const unsigned char sessionContext[] = "SimpleHttpServer";
+                SSL_CTX_set_session_id_context(native, sessionContext, sizeof(sessionContext) - 1);
+                if (tls.sessionCacheSize > 0)
+                {
+                    SSL_CTX_set_session_cache_mode(native, SSL_SESS_CACHE_SERVER);
+                    SSL_CTX_sess_set_cache_size(native, static_cast<long>(tls.sessionCacheSize));
+                }
+                else
+                    SSL_CTX_set_session_cache_mode(native, SSL_SESS_CACHE_OFF);
+                SSL_CTX_set_timeout(native, static_cast<long>(tls.sessionTimeout.count()));
+                if (!tls.sessionTickets)
+                    SSL_CTX_set_options(native, SSL_OP_NO_TICKET);
+
+                // ALPN wire format: length prefixed protocol names
+                for (auto& protocol : tls.alpn)
+                    if (!protocol.empty() && protocol.size() < 256)
                     {
-                        state = Post;
+                        m_Alpn.push_back(static_cast<char>(protocol.size()));
+                        m_Alpn += protocol;
                     }
-                    break;
+                if (!m_Alpn.empty())
+                    SSL_CTX_set_alpn_select_cb(native, &TlsListener::SelectProtocol, &m_Alpn);
+            }
+
+        private:
+            void Accepted(asio::ip::tcp::socket socket, Shard& shard) override
+            {
+                Start(std::make_shared<RequestSession<asio::ssl::stream<asio::ip::tcp::socket>>>(
+                    asio::ssl::stream<asio::ip::tcp::socket>(std::move(socket), m_Context), m_Server, &shard), shard);
+            }
+
+            // Picks our most preferred protocol the client offers. Clients
+            // offering none of them still get a connection, without ALPN.
+            static int SelectProtocol(SSL* ssl, const unsigned char** out, unsigned char* outLength,
+                const unsigned char* in, unsigned int inLength, void* argument)
+            {
+                auto& protocols = *static_cast<const std::string*>(argument);
+                unsigned char* selected = nullptr;
+                if (SSL_select_next_proto(&selected, outLength, reinterpret_cast<const unsigned char*>(protocols.data()),
+                    static_cast<unsigned int>(protocols.size()), in, inLength) != OPENSSL_NPN_NEGOTIATED)
+                    return SSL_TLSEXT_ERR_NOACK;
+                *out = selected;
+                return SSL_TLSEXT_ERR_OK;
+            }
+
+        private:
+            asio::ssl::context m_Context;
+            std::string m_Alpn;
+        };
+#endif
+    }
+
+    inline Responder& Responder::operator=(Responder&& other) noexcept
+    {
+        if (this != &other)
+        {
+            if (m_Session)
+            {
+                Response respond;
+                respond.status = 500;
+                Send(std::move(respond));
+            }
+            m_Session = std::move(other.m_Session);
+        }
+        return *this;
+    }
+
+    inline Responder::~Responder()
+    {
+        if (m_Session)
+        {
+            Response respond;
+            respond.status = 500;
+            Send(std::move(respond));
+        }
+    }
+
+    inline void Responder::Send(Response response)
+    {
+        if (!m_Session)
+            return;
+
+        auto session = std::move(m_Session);
+        auto executor = session->Executor();
+        asio::post(executor,
+            [session = std::move(session), response = std::move(response)] () mutable
+            {
+                session->Respond(std::move(response));
+            }
+        );
+    }
+
+    HttpServer::HttpServer(const std::string& address, uint_least16_t port)
+    {
+        Listen(address, port);
+    }
+
+    HttpServer::HttpServer()
+    {
+    }
+
+    HttpServer::~HttpServer()
+    {
+        Wait();
+
+        // Responses of offloaded requests cut by the deadline may still be
+        // queued, holding their sessions. They run here, on closed sockets,
+        // while the shards they use are alive.
+        m_OffloadPool.reset();
+        for (auto& shard : m_Shards)
+        {
+            shard->context->restart();
+            shard->context->poll();
+        }
+    }
+
+    void HttpServer::Wait()
+    {
+        if (m_ContextThread && m_ContextThread->joinable())
+            m_ContextThread->join();
+        for (auto& shard : m_Shards)
+            if (shard->thread.joinable())
+                shard->thread.join();
+    }
+
+    void HttpServer::Drain(std::chrono::milliseconds deadline)
+    {
+        BeginDrain(deadline);
+        Wait();
+    }
+
+    void HttpServer::Stop(std::chrono::milliseconds deadline)
+    {
+        Drain(deadline);
+    }
+
+    void HttpServer::DrainOnSignal(int signalNumber, std::chrono::milliseconds deadline)
+    {
+        m_DrainSignalDeadline = deadline;
+        if (!m_DrainSignals)
+        {
+            m_DrainSignals = std::make_unique<asio::signal_set>(m_IoContext);
+            WaitDrainSignal();
+        }
+        m_DrainSignals->add(signalNumber);
+    }
+
+    void HttpServer::WaitDrainSignal()
+    {
+        m_DrainSignals->async_wait(
+            [this] (const asio::error_code& ec, int signalNumber)
+            {
+                if (!ec)
+                    BeginDrain(m_DrainSignalDeadline);
+            }
+        );
+    }
+
+    void HttpServer::BeginDrain(std::chrono::milliseconds deadline)
+    {
+        // Saturated, milliseconds::max() never expires
+        auto now = std::chrono::steady_clock::now();
+        deadline = std::min(deadline, std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::time_point::max() - now));
+        asio::post(m_IoContext,
+            [this, until = now + deadline] ()
+            {
+                if (m_DrainFinished)
+                    return;
+                // A second call may only bring the deadline closer
+                if (m_Draining.exchange(true, std::memory_order_acq_rel))
+                {
+                    if (until < m_DrainTimer.expiry())
+                        m_DrainTimer.expires_at(until);
+                    else
+                        return;
+                }
+                else
+                {
+                    for (auto& listener : m_Listeners)
+                        listener->Close();
+                    // Pending signal waits would keep the context running
+                    asio::error_code ignored;
+                    if (m_DumpSignals)
+                        m_DumpSignals->cancel(ignored);
+                    if (m_AccessLogSignals)
+                        m_AccessLogSignals->cancel(ignored);
+                    if (m_DrainSignals)
+                        m_DrainSignals->cancel(ignored);
+#if defined(SIMPLE_HTTP_LISTENER_HANDOFF)
+                    CloseHandOff();
+#endif
+
+                    for (auto& shard : m_Shards)
+                        asio::post(*shard->context,
+                            [shard = shard.get()] ()
+                            {
+                                for (auto& session : shard->Sessions())
+                                    session->Drain(false);
+                            }
+                        );
+                    m_DrainTimer.expires_at(until);
                 }
-                case Post:
-                    if (true)
+
+                m_DrainTimer.async_wait(
+                    [this] (const asio::error_code& ec)
                     {
-                        for (auto& [name, value] : headers)
-                            req.headers[name] = std::move(value);
-                        for (auto& [name, value] : params)
-                            req.params[name] = std::move(value);
+                        if (!ec)
+                            FinishDrain(true);
                     }
-                    return ParsingCompleted;
-                    break;
-                default:
-                    return ParsingError;
+                );
+                // Nothing to wait for, or Start never ran
+                SessionClosedWhileDraining();
+            }
+        );
+    }
+
+    void HttpServer::SessionClosedWhileDraining()
+    {
+        asio::post(m_IoContext,
+            [this] ()
+            {
+                if (m_DrainFinished)
+                    return;
+                for (auto& shard : m_Shards)
+                    if (shard->connections.load(std::memory_order_acquire) > 0)
+                        return;
+                FinishDrain(false);
+            }
+        );
+    }
+
+    void HttpServer::FinishDrain(bool force)
+    {
+        m_DrainFinished = true;
+        m_DrainTimer.cancel();
+        for (auto& shard : m_Shards)
+            asio::post(*shard->context,
+                [shard = shard.get(), force] ()
+                {
+                    if (force)
+                        for (auto& session : shard->Sessions())
+                            session->Drain(true);
+                    shard->work.reset();
+                }
+            );
+    }
+    void HttpServer::SetOffloadPool(std::size_t threads, std::size_t maxQueueDepth)
+    {
+        m_OffloadThreads = threads;
+        m_OffloadQueueDepth = maxQueueDepth;
+    }
+
+    void HttpServer::SetWorkerThreads(std::size_t threads, ConnectionBalancing balancing)
+    {
+        m_WorkerThreads = std::max<std::size_t>(1, threads);
+        m_Balancing = balancing;
+    }
+
+    Details::Shard& HttpServer::NextShard()
+    {
+        if (m_Shards.size() == 1)
+            return *m_Shards[0];
+        if (m_Balancing == ConnectionBalancing::LeastConnections)
+        {
+            Details::Shard* least = m_Shards[0].get();
+            for (auto& shard : m_Shards)
+                if (shard->connections.load(std::memory_order_relaxed) < least->connections.load(std::memory_order_relaxed))
+                    least = shard.get();
+            return *least;
+        }
+        return *m_Shards[m_NextShard];
+    }
+
+    void HttpServer::AdvanceShard()
+    {
+        m_NextShard = (m_NextShard + 1) % m_Shards.size();
+    }
+
+    void HttpServer::SetResponseCache(std::size_t maxBytes)
+    {
+        m_ResponseCacheBytes = maxBytes;
+    }
+
+    ResponseCacheStats HttpServer::CacheStats() const
+    {
+        return m_ResponseCache ? m_ResponseCache->Stats() : ResponseCacheStats();
+    }
+
+    CoalescingStats HttpServer::CoalesceStats() const
+    {
+        return m_SingleFlight ? m_SingleFlight->Stats() : CoalescingStats();
+    }
+
+    void HttpServer::SetRegisteredBuffers(std::size_t count, std::size_t size)
+    {
+        m_RegisteredBufferCount = count;
+        m_RegisteredBufferSize = size;
+    }
+
+    void HttpServer::Listen(const std::string& address, uint_least16_t port, const ListenOptions& options)
+    {
+        m_Listeners.push_back(std::make_unique<Details::SocketListener<asio::ip::tcp>>(this,
+            Details::OpenAcceptor<asio::ip::tcp>(m_IoContext, asio::ip::tcp::endpoint(asio::ip::make_address(address), port), options),
+            options));
+    }
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+    void HttpServer::ListenUnix(const std::string& path, const ListenOptions& options)
+    {
+        m_Listeners.push_back(std::make_unique<Details::UnixListener>(this, m_IoContext, path, options));
+    }
+#endif
+
+#if defined(SIMPLE_HTTP_TLS)
+    void HttpServer::ListenTls(const std::string& address, uint_least16_t port, const TlsOptions& tls,
+        const ListenOptions& options)
+    {
+        m_Listeners.push_back(std::make_unique<Details::TlsListener>(this,
+            Details::OpenAcceptor<asio::ip::tcp>(m_IoContext, asio::ip::tcp::endpoint(asio::ip::make_address(address), port), options),
+            tls, options));
+    }
+#endif
+
+#if defined(SIMPLE_HTTP_LISTENER_HANDOFF)
+    void HttpServer::ListenFd(int fd, const ListenOptions& options)
+    {
+        int family = Details::SocketFamily(fd);
+        if (family == AF_INET || family == AF_INET6)
+            m_Listeners.push_back(std::make_unique<Details::SocketListener<asio::ip::tcp>>(this,
+                Details::AdoptAcceptor(m_IoContext, family == AF_INET ? asio::ip::tcp::v4() : asio::ip::tcp::v6(), fd, options),
+                options));
+        else if (family == AF_UNIX)
+            m_Listeners.push_back(std::make_unique<Details::SocketListener<asio::local::stream_protocol>>(this,
+                Details::AdoptAcceptor(m_IoContext, asio::local::stream_protocol(), fd, options), options));
+        else
+            throw std::invalid_argument("ListenFd: not a TCP or Unix domain socket");
+    }
+
+#if defined(SIMPLE_HTTP_TLS)
+    void HttpServer::ListenTlsFd(int fd, const TlsOptions& tls, const ListenOptions& options)
+    {
+        int family = Details::SocketFamily(fd);
+        if (family != AF_INET && family != AF_INET6)
+            throw std::invalid_argument("ListenTlsFd: not a TCP socket");
+        m_Listeners.push_back(std::make_unique<Details::TlsListener>(this,
+            Details::AdoptAcceptor(m_IoContext, family == AF_INET ? asio::ip::tcp::v4() : asio::ip::tcp::v6(), fd, options),
+            tls, options));
+    }
+#endif
+
+    std::vector<int> HttpServer::ListenerFds()
+    {
+        std::vector<int> fds = HandOffFds();
+        for (int fd : fds)
+            ::fcntl(fd, F_SETFD, ::fcntl(fd, F_GETFD) & ~FD_CLOEXEC);
+        return fds;
+    }
+
+    std::vector<int> HttpServer::HandOffFds()
+    {
+        std::vector<int> fds;
+        for (auto& listener : m_Listeners)
+            fds.push_back(listener->HandOff());
+        return fds;
+    }
+
+    void HttpServer::ServeHandOff(const std::string& path, std::chrono::milliseconds deadline)
+    {
+        m_HandOffPath = path;
+        m_HandOffDeadline = deadline;
+        // Restricted before listen, nothing can connect in between
+        auto endpoint = Details::RemoveStaleSocket(path);
+        m_HandOffAcceptor = std::make_unique<asio::local::stream_protocol::acceptor>(m_IoContext);
+        m_HandOffAcceptor->open(endpoint.protocol());
+        m_HandOffAcceptor->bind(endpoint);
+        if (::chmod(path.c_str(), S_IRUSR | S_IWUSR) != 0)
+            throw std::system_error(errno, std::generic_category(), "chmod");
+        m_HandOffAcceptor->listen();
+        WaitHandOff();
+    }
+
+    void HttpServer::WaitHandOff()
+    {
+        m_HandOffAcceptor->async_accept(
+            [this] (const asio::error_code& ec, asio::local::stream_protocol::socket socket)
+            {
+                if (ec)
+                    return;
+
+                if (!Details::PeerIsSameUser(socket.native_handle()))
+                {
+                    std::cerr << "Hand off refused to a process of another user" << std::endl;
+                    WaitHandOff();
+                    return;
+                }
+
+                // Gone before the new process can serve its own hand off
+                // at the same path
+                CloseHandOff();
+                try
+                {
+                    Details::SendFds(socket.native_handle(), HandOffFds());
+                }
+                catch (const std::exception& e)
+                {
+                    std::cerr << "Hand off failed: " << e.what() << std::endl;
+                    return;
                 }
+                BeginDrain(m_HandOffDeadline);
             }
+        );
+    }
 
-            return ParsingIncompleted;
+    void HttpServer::CloseHandOff()
+    {
+        if (!m_HandOffAcceptor || !m_HandOffAcceptor->is_open())
+            return;
+        asio::error_code ignored;
+        m_HandOffAcceptor->close(ignored);
+        std::error_code removeIgnored;
+        std::filesystem::remove(m_HandOffPath, removeIgnored);
+    }
+
+    std::vector<int> HttpServer::ReceiveListenerFds(const std::string& path)
+    {
+        asio::io_context context;
+        asio::local::stream_protocol::socket socket(context);
+        asio::error_code ec;
+        socket.connect(asio::local::stream_protocol::endpoint(path), ec);
+        if (ec)
+            return {}; // Nothing to take over
+        return Details::ReceiveFds(socket.native_handle());
+    }
+
+    std::vector<int> HttpServer::InheritedListenerFds(const char* variable)
+    {
+        std::vector<int> fds;
+        const char* value = std::getenv(variable);
+        if (!value)
+            return fds;
+        std::string_view list = value;
+        while (!list.empty())
+        {
+            std::size_t comma = list.find(',');
+            std::string item(list.substr(0, comma));
+            list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+            if (!item.empty())
+                fds.push_back(std::stoi(item));
         }
+        return fds;
+    }
+#endif
+
+    void HttpServer::EnableMetrics(const std::string& path)
+    {
+        m_MetricsPath = path;
+    }
+
+    std::string HttpServer::MetricsText() const
+    {
+        return m_Metrics.Render();
+    }
+
+    std::vector<PhaseSummary> HttpServer::PhaseStats() const
+    {
+        return m_PhaseHistograms.Summarize();
+    }
+
+    std::string HttpServer::PhaseReport() const
+    {
+        return m_PhaseHistograms.Report();
+    }
 
-        class RequestSession: public std::enable_shared_from_this<RequestSession>
+    void HttpServer::DumpPhaseStatsOnSignal(int signalNumber)
+    {
+        if (!m_DumpSignals)
         {
-        public:
-            RequestSession(asio::ip::tcp::socket socket, HttpServer* server) :
-                m_Socket(std::move(socket)), m_Server(server)
+            m_DumpSignals = std::make_unique<asio::signal_set>(m_IoContext);
+            WaitDumpSignal();
+        }
+        m_DumpSignals->add(signalNumber);
+    }
+
+    void HttpServer::WaitDumpSignal()
+    {
+        m_DumpSignals->async_wait(
+            [this] (const asio::error_code& ec, int signalNumber)
             {
+                if (ec)
+                    return;
+
+                std::cerr << m_PhaseHistograms.Report() << std::flush;
+                WaitDumpSignal();
             }
-            void Start()
+        );
+    }
+
+    void HttpServer::EnableAccessLog(const AccessLogOptions& options)
+    {
+        m_AccessLog = std::make_unique<Details::AccessLog>(options);
+        if (options.reopenSignal != 0)
+        {
+            m_AccessLogSignals = std::make_unique<asio::signal_set>(m_IoContext, options.reopenSignal);
+            WaitAccessLogSignal();
+        }
+    }
+
+    uint64_t HttpServer::DroppedAccessLogRecords() const
+    {
+        return m_AccessLog ? m_AccessLog->Dropped() : 0;
+    }
+
+    void HttpServer::WaitAccessLogSignal()
+    {
+        m_AccessLogSignals->async_wait(
+            [this] (const asio::error_code& ec, int signalNumber)
             {
-                ReadHeader();
+                if (ec)
+                    return;
+
+                m_AccessLog->Reopen();
+                WaitAccessLogSignal();
             }
+        );
+    }
 
-        private:
-            void MatchRequest(const std::vector<Handler>& handlers, const Request& req, Response& respond, bool& anyMatch)
+    void HttpServer::Start()
+    {
+        if (!m_MetricsPath.empty())
+            Get(m_MetricsPath, [this] (const Request& req, Response& res) {
+                res.SetContentType("text/plain; version=0.0.4");
+                res.body = m_Metrics.Render();
+            });
+
+        std::vector<Details::Metrics::RouteLabel> routeLabels;
+        for (std::size_t method = 0; method < MethodCount; method++)
+            for (auto& handler : m_Handlers[method])
             {
-                for (auto& handler : handlers)
-                    if (handler.first == req.path)
-                    {
-                        handler.second(req, respond);
-                        anyMatch = true;
-                    }
+                handler.id = routeLabels.size();
+                routeLabels.push_back({std::string(MethodName(static_cast<Method>(method))), handler.path});
             }
+        for (auto& router : m_StaticRouters)
+        {
+            router.firstId = routeLabels.size();
+            for (auto& [method, path] : router.routes)
+                routeLabels.push_back({std::string(method), std::string(path)});
+        }
+        m_OptionsRouteId = routeLabels.size();
+        routeLabels.push_back({"OPTIONS", "<automatic>"});
+        m_Metrics.Init(std::move(routeLabels));
+        BuildPathRoutes();
 
-            void Respond(Request req)
+        for (auto& handlers : m_Handlers)
+            for (auto& handler : handlers)
             {
-                Response respond;
-                
-                bool anyMatch = false;
-                if (req.method == "GET")
-                    MatchRequest(m_Server->m_GetHandlers, req, respond, anyMatch);
-                else if (req.method == "POST")
-                    MatchRequest(m_Server->m_PostHandlers, req, respond, anyMatch);
-                else if (req.method == "PUT")
-                    MatchRequest(m_Server->m_PutHandlers, req, respond, anyMatch);
-                else if (req.method == "DELETE")
-                    MatchRequest(m_Server->m_DeleteHandlers, req, respond, anyMatch);
-                
-                if (!anyMatch)
+                if (handler.options.offload && !m_OffloadPool)
+                    m_OffloadPool = std::make_unique<Details::WorkStealingPool>(m_OffloadThreads, m_OffloadQueueDepth);
+                if (handler.options.cache.ttl.count() > 0 && !m_ResponseCache)
+                    m_ResponseCache = std::make_unique<Details::ResponseCache>(m_ResponseCacheBytes);
+                if ((handler.options.cache.ttl.count() > 0 || handler.options.coalesce.enabled) && !m_SingleFlight)
+                    m_SingleFlight = std::make_unique<Details::SingleFlight>();
+            }
+
+        for (std::size_t i = 0; i < m_WorkerThreads; i++)
+        {
+            auto shard = std::make_unique<Details::Shard>();
+            if (i == 0)
+                shard->context = &m_IoContext;
+            else
+            {
+                shard->ownContext = std::make_unique<asio::io_context>(1);
+                shard->context = shard->ownContext.get();
+            }
+#if defined(SIMPLE_HTTP_REGISTERED_BUFFERS)
+            if (m_RegisteredBufferCount > 0 && m_RegisteredBufferSize > 0)
+            {
+                try
                 {
-                    m_Socket.shutdown(asio::ip::tcp::socket::shutdown_both);
-                    return;
+                    shard->registeredBuffers = std::make_unique<Details::RegisteredBufferPool>(
+                        *shard->context, m_RegisteredBufferCount, m_RegisteredBufferSize);
                 }
-
-                respond.headers["Content-Type"] += "; charset=UTF-8";
-                respond.headers["Content-Length"] = std::to_string(respond.body.size());    
-                respond.headers["Connection"] = "close";
-                respond.headers["Server"] = "SimpleHttpServer";
-                if (!respond.location.empty()) respond.headers["Location"] = respond.location;
-                std::time_t now = std::time(0);
-                auto& date = respond.headers["Date"];
-                date.resize(30);
-                std::strftime((char *)date.c_str(), date.size(), "%a, %d %b %Y %T GMT", std::gmtime(&now));
-
-                std::ostringstream finalResponse;
-                finalResponse << "HTTP/1.1 " << respond.status << " " << Details::StatusMessage(respond.status) << "\r\n";
-                for (auto& [name, value] : respond.headers)
+                catch (const std::exception& e)
                 {
-                    finalResponse << name + ": " << value << "\r\n";
+                    // Usually RLIMIT_MEMLOCK, the sessions use their own buffers
+                    std::cerr << "Registered buffers disabled: " << e.what() << std::endl;
                 }
-                finalResponse << "\r\n" <<
-                respond.body;
-
-                Respond(finalResponse.str()); 
             }
+#endif
+            shard->work.emplace(shard->context->get_executor());
+            m_Shards.push_back(std::move(shard));
+        }
 
-            void Respond(const std::string& respondData)
-            {
-                auto self(shared_from_this());
-                m_Socket.async_write_some(asio::buffer(respondData.data(), respondData.size()), 
-                    [this, self] (const asio::error_code& ec, size_t bytesTransfered)
+        for (auto& shard : m_Shards)
+            if (shard->ownContext)
+                shard->thread = std::thread(
+                    [context = shard->ownContext.get()] ()
                     {
-                        if(!ec)
-                        {
-                            m_Socket.shutdown(asio::ip::tcp::socket::shutdown_both);
-                        }
-                        else
-                        {
-                            m_Socket.close();
-                        }
+                        context->run();
                     }
                 );
-            }
 
-            void ReadBody(Request req)
+        m_ContextThread = std::make_shared<std::thread>(
+            [this] ()
             {
-                auto self(shared_from_this());
-                if (req.body.size() == req.contentLength)
-                    Respond(std::move(req));
+                for (auto& listener : m_Listeners)
+                    listener->Accept();
+                m_IoContext.run();
+            }
+        );
+    }
+    void HttpServer::Get(const std::string& pathPattern, CallbackHandler requestHandler, RouteOptions options)
+    {
+        AddRoute(Method::Get, pathPattern, std::move(requestHandler), options);
+    }
 
-                bodyBuffer.clear(); 
-                bodyBuffer.resize(m_Socket.available());
-                m_Socket.async_read_some(asio::buffer(bodyBuffer, bodyBuffer.size()),
-                    [this, self, req = std::move(req)] (const asio::error_code& ec, size_t bytesTransfered) mutable
-                    {
-                        if (!ec)
-                        {
-                            req.body.append(reinterpret_cast<char const*>(bodyBuffer.data()), bytesTransfered);
+    void HttpServer::Get(const std::string& pathPattern, DeferredCallbackHandler requestHandler, RouteOptions options)
+    {
+        AddRoute(Method::Get, pathPattern, std::move(requestHandler), options);
+    }
 
-                            Respond(std::move(req));
-                        }
-                        else if (ec == asio::error::operation_aborted)
-                            m_Socket.close();
-                    }
-                );
-            }
+    void HttpServer::Post(const std::string& pathPattern, CallbackHandler requestHandler, RouteOptions options)
+    {
+        AddRoute(Method::Post, pathPattern, std::move(requestHandler), options);
+    }
 
-            void ReadHeader()
-            {
-                auto self(shared_from_this());
-                asio::async_read_until(m_Socket, m_RequestBuffer, Details::END_TOKEN,
-                    [this, self] (const asio::error_code& ec, size_t bytesTransfered)
-                    {
-                        std::ostringstream ss;
-                        ss << &m_RequestBuffer;
+    void HttpServer::Post(const std::string& pathPattern, DeferredCallbackHandler requestHandler, RouteOptions options)
+    {
+        AddRoute(Method::Post, pathPattern, std::move(requestHandler), options);
+    }
 
-                        const std::string& requestStr = ss.str();
+    void HttpServer::Put(const std::string& pathPattern, CallbackHandler requestHandler, RouteOptions options)
+    {
+        AddRoute(Method::Put, pathPattern, std::move(requestHandler), options);
+    }
 
-                        Request req; 
-                        Details::ParseRequest(ss.str(), req);
+    void HttpServer::Put(const std::string& pathPattern, DeferredCallbackHandler requestHandler, RouteOptions options)
+    {
+        AddRoute(Method::Put, pathPattern, std::move(requestHandler), options);
+    }
 
-                        auto found = requestStr.find(END_TOKEN) + std::strlen(END_TOKEN);
-                        size_t bytesExceeded = requestStr.size() - found;
-                        req.body.append(requestStr.substr(found));
+    void HttpServer::Delete(const std::string& pathPattern, CallbackHandler requestHandler, RouteOptions options)
+    {
+        AddRoute(Method::Delete, pathPattern, std::move(requestHandler), options);
+    }
 
-                        ReadBody(std::move(req));
+    void HttpServer::Delete(const std::string& pathPattern, DeferredCallbackHandler requestHandler, RouteOptions options)
+    {
+        AddRoute(Method::Delete, pathPattern, std::move(requestHandler), options);
+    }
 
-                        if (ec)
-                            m_Socket.close();
-                    }
-                );
-            }
+    void HttpServer::Head(const std::string& pathPattern, CallbackHandler requestHandler, RouteOptions options)
+    {
+        AddRoute(Method::Head, pathPattern, std::move(requestHandler), options);
+    }
 
-        private:
-            HttpServer* m_Server;
-            asio::ip::tcp::socket m_Socket;
-            asio::streambuf m_RequestBuffer;
-            std::vector<uint8_t> bodyBuffer;
-        };
+    void HttpServer::Head(const std::string& pathPattern, DeferredCallbackHandler requestHandler, RouteOptions options)
+    {
+        AddRoute(Method::Head, pathPattern, std::move(requestHandler), options);
     }
 
-    HttpServer::HttpServer(const std::string& address, uint_least16_t port) :
-        m_Acceptor(m_IoContext, asio::ip::tcp::endpoint(asio::ip::address::from_string(address), port))
+    void HttpServer::Options(const std::string& pathPattern, CallbackHandler requestHandler, RouteOptions options)
     {
+        AddRoute(Method::Options, pathPattern, std::move(requestHandler), options);
     }
 
-    HttpServer::~HttpServer()
+    void HttpServer::Options(const std::string& pathPattern, DeferredCallbackHandler requestHandler, RouteOptions options)
     {
-        if (m_ContextThread->joinable())
-            m_ContextThread->join();
+        AddRoute(Method::Options, pathPattern, std::move(requestHandler), options);
     }
-    void HttpServer::Start()
+
+    void HttpServer::Patch(const std::string& pathPattern, CallbackHandler requestHandler, RouteOptions options)
     {
-        m_ContextThread = std::make_shared<std::thread>(
-            [this] ()
-            {
-                DoAccept();
-                m_IoContext.run();
-            }
-        );
+        AddRoute(Method::Patch, pathPattern, std::move(requestHandler), options);
     }
-    void HttpServer::Get(const std::string& pathPattern, CallbackHandler requestHandler)
+
+    void HttpServer::Patch(const std::string& pathPattern, DeferredCallbackHandler requestHandler, RouteOptions options)
     {
-        m_GetHandlers.push_back({pathPattern, requestHandler});
+        AddRoute(Method::Patch, pathPattern, std::move(requestHandler), options);
     }
 
-    void HttpServer::Post(const std::string& pathPattern, CallbackHandler requestHandler)
+    void HttpServer::AddRoute(Method method, const std::string& pathPattern, CallbackHandler requestHandler, RouteOptions options)
     {
-        m_PostHandlers.push_back({pathPattern, requestHandler});
+        m_Handlers[static_cast<std::size_t>(method)].push_back({pathPattern, std::move(requestHandler), nullptr, options});
     }
 
-    void HttpServer::Put(const std::string& pathPattern, CallbackHandler requestHandler)
+    void HttpServer::AddRoute(Method method, const std::string& pathPattern, DeferredCallbackHandler requestHandler, RouteOptions options)
     {
-        m_PutHandlers.push_back({pathPattern, requestHandler});
+        m_Handlers[static_cast<std::size_t>(method)].push_back({pathPattern, nullptr, std::move(requestHandler), options});
     }
 
-    void HttpServer::Delete(const std::string& pathPattern, CallbackHandler requestHandler)
+    std::string HttpServer::AllowedMethods(const std::string& path) const
     {
-        m_DeleteHandlers.push_back({pathPattern, requestHandler});
+        // "*" asks for the methods of the whole server
+        auto routed = [this, &path] (Method method) {
+            for (auto& handler : m_Handlers[static_cast<std::size_t>(method)])
+                if (path == "*" || handler.path == path)
+                    return true;
+            for (auto& router : m_StaticRouters)
+                for (auto& [routeMethod, routePath] : router.routes)
+                    if (routeMethod == MethodName(method) && (path == "*" || routePath == path))
+                        return true;
+            return false;
+        };
+
+        std::string allow;
+        for (std::size_t index = 0; index < MethodCount; index++)
+        {
+            Method method = static_cast<Method>(index);
+            bool allowed = method == Method::Options || routed(method) ||
+                (method == Method::Head && routed(Method::Get));
+            if (!allowed)
+                continue;
+
+            if (!allow.empty())
+                allow += ", ";
+            allow += MethodName(method);
+        }
+        return allow;
     }
 
-    void HttpServer::DoAccept()
+    void HttpServer::BuildPathRoutes()
     {
-        m_Acceptor.async_accept(
-            [this] (const asio::error_code& ec, asio::ip::tcp::socket socket)
-            {
-                if (!m_Acceptor.is_open())
-                    return;
+        std::vector<std::string> paths = { "*" };
+        for (auto& handlers : m_Handlers)
+            for (auto& handler : handlers)
+                paths.push_back(handler.path);
+        for (auto& router : m_StaticRouters)
+            for (auto& [method, path] : router.routes)
+                paths.emplace_back(path);
 
-                if(!ec)
-                    std::make_shared<Details::RequestSession>(std::move(socket), this)->Start();
+        for (auto& path : paths)
+        {
+            if (m_PathRoutes.count(path))
+                continue;
 
-                DoAccept();
-            }
-        );
+            Details::PathRoutes routes;
+            routes.allow = AllowedMethods(path);
+            routes.options = Details::RenderOptionsResponse(routes.allow, nullptr);
+            if (m_Cors)
+                routes.preflight = Details::RenderOptionsResponse(routes.allow, m_Cors.get());
+            m_PathRoutes.emplace(path, std::move(routes));
+        }
+    }
+
+    void HttpServer::SetLimits(const ServerLimits& limits)
+    {
+        m_Limits = limits;
+    }
+
+    void HttpServer::SetErrorHandler(CallbackHandler handler)
+    {
+        m_ErrorHandler = std::move(handler);
+    }
+
+    void HttpServer::EnableCors(const CorsOptions& options)
+    {
+        m_Cors = std::make_unique<CorsOptions>(options);
+    }
+
+#if defined(SIMPLE_HTTP_ZLIB)
+    void HttpServer::EnableCompression(const CompressionOptions& options)
+    {
+        m_Compression = std::make_unique<CompressionOptions>(options);
+    }
+#endif
+
+    bool HttpServer::IsAllowedOrigin(const std::string& origin) const
+    {
+        for (auto& allowed : m_Cors->allowOrigins)
+            if (allowed == "*" || allowed == origin)
+                return true;
+        return false;
     }
 }